@@ -1,5 +1,6 @@
 #include "geometry.h"
 #include <cmath>
+#include <limits>
 
 bool IntersectRaySphere(const Ray & ray, const float3 & center, float radius, float * outT, float3 * outNormal)
 {
@@ -16,19 +17,30 @@ bool IntersectRaySphere(const Ray & ray, const float3 & center, float radius, fl
     }
 
     if(outT) *outT = t;
-    if(outNormal) *outNormal = t ? (ray.direction * t - delta) / radius : norm(ray.direction * t - delta);
+    // Rounding leaves grazing hits slightly off the surface, so the normal is normalized rather than divided by the radius. Otherwise, the error
+    // would grow with each reflection, until colors became infinite.
+    if(outNormal) *outNormal = norm(ray.direction * t - delta);
     return true;
 }
 
 bool IntersectRayTriangle(const Ray & ray, const float3 & vertex0, const float3 & vertex1, const float3 & vertex2, float * outT, float2 * outUv)
 {
-    auto e1 = vertex1 - vertex0, e2 = vertex2 - vertex0;
+    PrecomputedTriangle triangle;
+    triangle.vertex0 = vertex0;
+    triangle.edge1 = vertex1 - vertex0;
+    triangle.edge2 = vertex2 - vertex0;
+    return IntersectRayTriangle(ray, triangle, outT, outUv);
+}
+
+bool IntersectRayTriangle(const Ray & ray, const PrecomputedTriangle & triangle, float * outT, float2 * outUv)
+{
+    auto & e1 = triangle.edge1, & e2 = triangle.edge2;
     auto h = cross(ray.direction, e2);
     auto a = dot(e1, h);
     if (a < 0) return false;
 
     auto f = 1/a;
-    auto s = ray.origin - vertex0;
+    auto s = ray.origin - triangle.vertex0;
     auto u = f * dot(s,h);
     if (u < 0 || u > 1) return false;
 
@@ -43,3 +55,91 @@ bool IntersectRayTriangle(const Ray & ray, const float3 & vertex0, const float3
     if(outUv) *outUv = {u,v};
     return true;
 }
+
+
+TriangleBatch::TriangleBatch()
+{
+    std::fill(&vertex0[0][0], &edge2[2][SIMD_WIDTH-1]+1, std::numeric_limits<float>::quiet_NaN());
+}
+
+void TriangleBatch::SetTriangle(int lane, const float3 & vertex0, const float3 & vertex1, const float3 & vertex2)
+{
+    SetTriangle(lane, PrecomputedTriangle(vertex0, vertex1, vertex2));
+}
+
+void TriangleBatch::SetTriangle(int lane, const PrecomputedTriangle & triangle)
+{
+    auto & v0 = triangle.vertex0, & e1 = triangle.edge1, & e2 = triangle.edge2;
+    vertex0[0][lane] = v0.x; vertex0[1][lane] = v0.y; vertex0[2][lane] = v0.z;
+    edge1[0][lane] = e1.x; edge1[1][lane] = e1.y; edge1[2][lane] = e1.z;
+    edge2[0][lane] = e2.x; edge2[1][lane] = e2.y; edge2[2][lane] = e2.z;
+}
+
+int IntersectRayTriangles(const Ray & ray, const TriangleBatch & batch, float maxT, float * outT, float2 * outUv)
+{
+    vfloat3 direction = {ray.direction.x, ray.direction.y, ray.direction.z};
+    vfloat3 e1 = {vfloat::Load(batch.edge1[0]), vfloat::Load(batch.edge1[1]), vfloat::Load(batch.edge1[2])};
+    vfloat3 e2 = {vfloat::Load(batch.edge2[0]), vfloat::Load(batch.edge2[1]), vfloat::Load(batch.edge2[2])};
+    vfloat3 s = {vfloat(ray.origin.x) - vfloat::Load(batch.vertex0[0]), vfloat(ray.origin.y) - vfloat::Load(batch.vertex0[1]), vfloat(ray.origin.z) - vfloat::Load(batch.vertex0[2])};
+
+    // Every comparison is written so that NaN lanes fail it
+    auto h = cross(direction, e2);
+    auto a = dot(e1, h);
+    auto f = vfloat(1) / a;
+    auto u = f * dot(s, h);
+    auto q = cross(s, e1);
+    auto v = f * dot(direction, q);
+    auto t = f * dot(e2, q);
+    auto hit = (a > 0) & (u >= 0) & (u <= 1) & (v >= 0) & (u + v <= 1) & (t >= 0) & (t < maxT);
+    if(!hit.GetBits()) return -1;
+
+    auto hitT = select(hit, t, std::numeric_limits<float>::infinity());
+    float bestT = reduce_min(hitT);
+    int lane = 0;
+    for(int bits = (hitT == bestT).GetBits(); !(bits & 1); bits >>= 1) ++lane;
+
+    if(outT) *outT = bestT;
+    if(outUv)
+    {
+        float us[SIMD_WIDTH], vs[SIMD_WIDTH];
+        u.Store(us);
+        v.Store(vs);
+        *outUv = {us[lane], vs[lane]};
+    }
+    return lane;
+}
+
+void RayPacket::AddRay(const Ray & ray)
+{
+    origin[0][size] = ray.origin.x; origin[1][size] = ray.origin.y; origin[2][size] = ray.origin.z;
+    direction[0][size] = ray.direction.x; direction[1][size] = ray.direction.y; direction[2][size] = ray.direction.z;
+    invDirection[0][size] = 1/ray.direction.x; invDirection[1][size] = 1/ray.direction.y; invDirection[2][size] = 1/ray.direction.z;
+    ++size;
+}
+
+vmask IntersectRaysSphere(const vfloat3 & origin, const vfloat3 & direction, const float3 & center, float radius, const vfloat & maxT, vfloat * outT)
+{
+    // Matches IntersectRaySphere, including reporting a distance of zero for rays which start inside the sphere
+    auto delta = vfloat3{center.x, center.y, center.z} - origin;
+    auto b = dot(direction, delta), disc = b*b + vfloat(radius*radius) - dot(delta, delta);
+    auto root = sqrt(max(disc, vfloat(0)));
+    auto t0 = b - root, t1 = b + root;
+    auto t = select(t0 > 0, t0, vfloat(0));
+    *outT = t;
+    return (disc >= 0) & (t1 > 0) & (t < maxT);
+}
+
+vmask IntersectRaysTriangle(const vfloat3 & origin, const vfloat3 & direction, const float3 & vertex0, const float3 & edge1, const float3 & edge2, const vfloat & maxT, vfloat * outT)
+{
+    vfloat3 e1 = {edge1.x, edge1.y, edge1.z}, e2 = {edge2.x, edge2.y, edge2.z};
+    auto s = origin - vfloat3{vertex0.x, vertex0.y, vertex0.z};
+    auto h = cross(direction, e2);
+    auto a = dot(e1, h);
+    auto f = vfloat(1) / a;
+    auto u = f * dot(s, h);
+    auto q = cross(s, e1);
+    auto v = f * dot(direction, q);
+    auto t = f * dot(e2, q);
+    *outT = t;
+    return (a > 0) & (u >= 0) & (u <= 1) & (v >= 0) & (u + v <= 1) & (t >= 0) & (t < maxT);
+}
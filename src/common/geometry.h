@@ -1,6 +1,10 @@
 #pragma once
 
 #include "linalg.h"
+#include "simd.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
 
 struct Ray
 {
@@ -11,6 +15,112 @@ struct Ray
 bool IntersectRaySphere(const Ray & ray, const float3 & center, float radius, float * outT=0, float3 * outNormal=0);
 bool IntersectRayTriangle(const Ray & ray, const float3 & vertex0, const float3 & vertex1, const float3 & vertex2, float * outT=0, float2 * outUv=0);
 
+// Triangle stored ready for intersection, so that testing it requires neither indexing into a vertex array nor recomputing its edges and normal
+struct PrecomputedTriangle
+{
+    float3 vertex0, edge1, edge2, normal;
+
+    PrecomputedTriangle() {}
+    PrecomputedTriangle(const float3 & vertex0, const float3 & vertex1, const float3 & vertex2) : vertex0(vertex0), edge1(vertex1 - vertex0), edge2(vertex2 - vertex0), normal(norm(cross(edge1, edge2))) {}
+};
+
+// Performs exactly the same test as IntersectRayTriangle on the original vertices
+bool IntersectRayTriangle(const Ray & ray, const PrecomputedTriangle & triangle, float * outT=0, float2 * outUv=0);
+
+// Up to SIMD_WIDTH triangles in structure-of-arrays layout, with edges precomputed. Unused lanes hold NaNs, which never report a hit.
+struct TriangleBatch
+{
+    float vertex0[3][SIMD_WIDTH], edge1[3][SIMD_WIDTH], edge2[3][SIMD_WIDTH];
+
+    TriangleBatch();
+
+    void SetTriangle(int lane, const float3 & vertex0, const float3 & vertex1, const float3 & vertex2);
+    void SetTriangle(int lane, const PrecomputedTriangle & triangle);
+
+    float3 GetVertex0(int lane) const { return {vertex0[0][lane], vertex0[1][lane], vertex0[2][lane]}; }
+    float3 GetEdge1(int lane) const { return {edge1[0][lane], edge1[1][lane], edge1[2][lane]}; }
+    float3 GetEdge2(int lane) const { return {edge2[0][lane], edge2[1][lane], edge2[2][lane]}; }
+};
+
+// Performs the same test as IntersectRayTriangle against every triangle in the batch at once. Returns the lane of the closest hit nearer than maxT, or -1 if there is none.
+int IntersectRayTriangles(const Ray & ray, const TriangleBatch & batch, float maxT, float * outT=0, float2 * outUv=0);
+
+struct Bounds
+{
+    float3 min, max;
+
+    Bounds() : min(std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity()), max(-min) {}
+    Bounds(const float3 & min, const float3 & max) : min(min), max(max) {}
+
+    bool IsEmpty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+    float3 GetCenter() const { return (min + max) * 0.5f; }
+    float GetSurfaceArea() const { auto size = max - min; return IsEmpty() ? 0 : (size.x*size.y + size.y*size.z + size.z*size.x) * 2; }
+
+    void Include(const float3 & point) { Include(Bounds(point, point)); }
+    void Include(const Bounds & bounds) { min = min.zip(bounds.min, [](float a, float b) { return std::min(a,b); }); max = max.zip(bounds.max, [](float a, float b) { return std::max(a,b); }); }
+};
+
+// invDirection must be the componentwise reciprocal of ray.direction, usually computed once per ray and reused for many boxes
+inline bool IntersectRayBox(const Ray & ray, const float3 & invDirection, const Bounds & box, float maxT, float * outT=0)
+{
+    auto t0 = (box.min - ray.origin) * invDirection, t1 = (box.max - ray.origin) * invDirection;
+    float tMin = std::max(std::max(std::min(t0.x, t1.x), std::min(t0.y, t1.y)), std::max(std::min(t0.z, t1.z), 0.0f));
+    float tMax = std::min(std::min(std::max(t0.x, t1.x), std::max(t0.y, t1.y)), std::min(std::max(t0.z, t1.z), maxT));
+    if(tMin > tMax) return false;
+    if(outT) *outT = tMin;
+    return true;
+}
+
+// Up to MaxSize rays stored in structure-of-arrays layout, processed SIMD_WIDTH lanes at a time. Lane masks use one bit per ray.
+struct RayPacket
+{
+    enum { MaxSize = 64 };
+
+    int size;
+    float origin[3][MaxSize], direction[3][MaxSize], invDirection[3][MaxSize];
+
+    RayPacket() : size(0) {}
+
+    static int GetGroupMask(uint64_t mask, int group) { return (int)(mask >> (group*SIMD_WIDTH)) & ((1 << SIMD_WIDTH) - 1); }
+
+    int GetGroupCount() const { return (size + SIMD_WIDTH - 1) / SIMD_WIDTH; }
+    uint64_t GetMask() const { return size == MaxSize ? ~0ull : (1ull << size) - 1; }
+    Ray GetRay(int lane) const { return {{origin[0][lane], origin[1][lane], origin[2][lane]}, {direction[0][lane], direction[1][lane], direction[2][lane]}}; }
+    vfloat3 GetOrigins(int group) const { return {vfloat::Load(&origin[0][group*SIMD_WIDTH]), vfloat::Load(&origin[1][group*SIMD_WIDTH]), vfloat::Load(&origin[2][group*SIMD_WIDTH])}; }
+    vfloat3 GetDirections(int group) const { return {vfloat::Load(&direction[0][group*SIMD_WIDTH]), vfloat::Load(&direction[1][group*SIMD_WIDTH]), vfloat::Load(&direction[2][group*SIMD_WIDTH])}; }
+    vfloat3 GetInvDirections(int group) const { return {vfloat::Load(&invDirection[0][group*SIMD_WIDTH]), vfloat::Load(&invDirection[1][group*SIMD_WIDTH]), vfloat::Load(&invDirection[2][group*SIMD_WIDTH])}; }
+
+    void Clear() { size = 0; }
+    void AddRay(const Ray & ray);
+};
+
+// Tests every lane of a group of rays against a single primitive, returning a mask of the lanes which hit it nearer than maxT
+vmask IntersectRaysSphere(const vfloat3 & origin, const vfloat3 & direction, const float3 & center, float radius, const vfloat & maxT, vfloat * outT);
+vmask IntersectRaysTriangle(const vfloat3 & origin, const vfloat3 & direction, const float3 & vertex0, const float3 & edge1, const float3 & edge2, const vfloat & maxT, vfloat * outT);
+
+// Returns the lanes in mask which hit the box nearer than their own entry in maxT, storing the smallest entry distance of those lanes in outT
+inline uint64_t IntersectRaysBox(const RayPacket & packet, uint64_t mask, const Bounds & box, const float * maxT, float * outT)
+{
+    uint64_t hits = 0;
+    vfloat minT = std::numeric_limits<float>::infinity();
+    for(int group=0, groups=packet.GetGroupCount(); group<groups; ++group)
+    {
+        int groupMask = RayPacket::GetGroupMask(mask, group);
+        if(!groupMask) continue;
+        auto origin = packet.GetOrigins(group), invDirection = packet.GetInvDirections(group);
+        auto t0x = (vfloat(box.min.x) - origin.x) * invDirection.x, t1x = (vfloat(box.max.x) - origin.x) * invDirection.x;
+        auto t0y = (vfloat(box.min.y) - origin.y) * invDirection.y, t1y = (vfloat(box.max.y) - origin.y) * invDirection.y;
+        auto t0z = (vfloat(box.min.z) - origin.z) * invDirection.z, t1z = (vfloat(box.max.z) - origin.z) * invDirection.z;
+        auto tMin = max(max(min(t0x, t1x), min(t0y, t1y)), max(min(t0z, t1z), vfloat(0)));
+        auto tMax = min(min(max(t0x, t1x), max(t0y, t1y)), min(max(t0z, t1z), vfloat::Load(maxT + group*SIMD_WIDTH)));
+        auto hit = (tMin <= tMax) & vmask::FromBits(groupMask);
+        hits |= (uint64_t)hit.GetBits() << (group*SIMD_WIDTH);
+        minT = min(minT, select(hit, tMin, std::numeric_limits<float>::infinity()));
+    }
+    *outT = reduce_min(minT);
+    return hits;
+}
+
 struct Pose
 {
     float3 position;
@@ -25,6 +135,9 @@ struct Pose
 
     float3 TransformPoint(const float3 & point) const { return position + TransformDirection(point); }
     float3 TransformDirection(const float3 & direction) const { return qrot(orientation, direction); }
+    float3 DetransformPoint(const float3 & point) const { return DetransformDirection(point - position); }
+    float3 DetransformDirection(const float3 & direction) const { return qrot(qconj(orientation), direction); }
+    Pose GetInverse() const { auto q = qconj(orientation); return {qrot(q, -position), q}; }
 };
 
 inline Pose operator * (const Pose & a, const Pose & b) { return {a.TransformPoint(b.position), qmul(a.orientation, b.orientation)}; }
@@ -0,0 +1,75 @@
+#include "mapped-file.h"
+
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+MappedFile::MappedFile(const char * filename) : data(), size(), file(INVALID_HANDLE_VALUE), mapping()
+{
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE) throw std::runtime_error(std::string("Unable to open ") + filename + ".");
+
+    LARGE_INTEGER fileSize;
+    if(!GetFileSizeEx(file, &fileSize))
+    {
+        CloseHandle(file);
+        throw std::runtime_error(std::string("Unable to read ") + filename + ".");
+    }
+    size = (size_t)fileSize.QuadPart;
+    if(size == 0) return; // Empty files cannot be mapped, but need not be
+
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if(mapping) data = reinterpret_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if(!data)
+    {
+        if(mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        throw std::runtime_error(std::string("Unable to map ") + filename + ".");
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if(data) UnmapViewOfFile(data);
+    if(mapping) CloseHandle(mapping);
+    CloseHandle(file);
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const char * filename) : data(), size(), file(-1)
+{
+    file = open(filename, O_RDONLY);
+    if(file < 0) throw std::runtime_error(std::string("Unable to open ") + filename + ".");
+
+    struct stat status;
+    if(fstat(file, &status) != 0)
+    {
+        close(file);
+        throw std::runtime_error(std::string("Unable to read ") + filename + ".");
+    }
+    size = (size_t)status.st_size;
+    if(size == 0) return; // Empty files cannot be mapped, but need not be
+
+    void * address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+    if(address == MAP_FAILED)
+    {
+        close(file);
+        throw std::runtime_error(std::string("Unable to map ") + filename + ".");
+    }
+    data = reinterpret_cast<const uint8_t *>(address);
+}
+
+MappedFile::~MappedFile()
+{
+    if(data) munmap(const_cast<uint8_t *>(data), size);
+    close(file);
+}
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Read-only view of a whole file, mapped into memory rather than read into a buffer, so that the operating system loads pages as they are touched
+// and shares them with every other process mapping the same file
+class MappedFile
+{
+    const uint8_t * data;
+    size_t size;
+#ifdef _WIN32
+    void * file, * mapping;
+#else
+    int file;
+#endif
+
+    MappedFile(const MappedFile &); // Noncopyable
+public:
+    MappedFile(const char * filename); // Throws std::runtime_error if the file cannot be opened or mapped
+    ~MappedFile();
+
+    const uint8_t * GetData() const { return data; }
+    size_t GetSize() const { return size; }
+};
@@ -0,0 +1,134 @@
+#pragma once
+
+// Thin wrappers over SSE or AVX registers. Building with AVX enabled (/arch:AVX or -mavx) selects 8-wide registers, otherwise 4-wide SSE is used.
+#ifdef __AVX__
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#else
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#endif
+
+#ifdef __AVX__
+
+struct vmask
+{
+    __m256 v;
+
+    vmask(__m256 v) : v(v) {}
+
+    // Sets lane i if bit i of bits is set
+    static vmask FromBits(int bits)
+    {
+        auto b = _mm_set1_epi32(bits), lo = _mm_setr_epi32(1,2,4,8), hi = _mm_setr_epi32(16,32,64,128);
+        auto maskLo = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(b, lo), lo)), maskHi = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(b, hi), hi));
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(maskLo), maskHi, 1);
+    }
+
+    int GetBits() const { return _mm256_movemask_ps(v); }
+};
+
+struct vfloat
+{
+    __m256 v;
+
+    vfloat() : v(_mm256_setzero_ps()) {}
+    vfloat(float f) : v(_mm256_set1_ps(f)) {}
+    vfloat(__m256 v) : v(v) {}
+
+    static vfloat Load(const float * p) { return _mm256_loadu_ps(p); }
+    void Store(float * p) const { _mm256_storeu_ps(p, v); }
+    void StoreRounded(int * p) const { _mm256_storeu_si256((__m256i *)p, _mm256_cvtps_epi32(v)); } // Rounds each lane to the nearest integer
+};
+
+inline vfloat operator + (const vfloat & a, const vfloat & b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat operator - (const vfloat & a, const vfloat & b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat operator * (const vfloat & a, const vfloat & b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat operator / (const vfloat & a, const vfloat & b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat sqrt(const vfloat & a) { return _mm256_sqrt_ps(a.v); }
+inline vfloat min(const vfloat & a, const vfloat & b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat max(const vfloat & a, const vfloat & b) { return _mm256_max_ps(a.v, b.v); }
+
+inline vmask operator <  (const vfloat & a, const vfloat & b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vmask operator <= (const vfloat & a, const vfloat & b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline vmask operator >  (const vfloat & a, const vfloat & b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline vmask operator >= (const vfloat & a, const vfloat & b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline vmask operator == (const vfloat & a, const vfloat & b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline vmask operator & (const vmask & a, const vmask & b) { return _mm256_and_ps(a.v, b.v); }
+inline vmask operator | (const vmask & a, const vmask & b) { return _mm256_or_ps(a.v, b.v); }
+inline vmask andnot(const vmask & a, const vmask & b) { return _mm256_andnot_ps(b.v, a.v); } // a & ~b
+
+inline vfloat select(const vmask & m, const vfloat & a, const vfloat & b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+
+inline float reduce_min(const vfloat & a)
+{
+    auto m = _mm_min_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1));
+    m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+    return _mm_cvtss_f32(_mm_min_ss(m, _mm_shuffle_ps(m, m, 1)));
+}
+
+#else
+
+struct vmask
+{
+    __m128 v;
+
+    vmask(__m128 v) : v(v) {}
+
+    // Sets lane i if bit i of bits is set
+    static vmask FromBits(int bits)
+    {
+        auto b = _mm_set1_epi32(bits), lanes = _mm_setr_epi32(1,2,4,8);
+        return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(b, lanes), lanes));
+    }
+
+    int GetBits() const { return _mm_movemask_ps(v); }
+};
+
+struct vfloat
+{
+    __m128 v;
+
+    vfloat() : v(_mm_setzero_ps()) {}
+    vfloat(float f) : v(_mm_set1_ps(f)) {}
+    vfloat(__m128 v) : v(v) {}
+
+    static vfloat Load(const float * p) { return _mm_loadu_ps(p); }
+    void Store(float * p) const { _mm_storeu_ps(p, v); }
+    void StoreRounded(int * p) const { _mm_storeu_si128((__m128i *)p, _mm_cvtps_epi32(v)); } // Rounds each lane to the nearest integer
+};
+
+inline vfloat operator + (const vfloat & a, const vfloat & b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat operator - (const vfloat & a, const vfloat & b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat operator * (const vfloat & a, const vfloat & b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat operator / (const vfloat & a, const vfloat & b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat sqrt(const vfloat & a) { return _mm_sqrt_ps(a.v); }
+inline vfloat min(const vfloat & a, const vfloat & b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat max(const vfloat & a, const vfloat & b) { return _mm_max_ps(a.v, b.v); }
+
+inline vmask operator <  (const vfloat & a, const vfloat & b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vmask operator <= (const vfloat & a, const vfloat & b) { return _mm_cmple_ps(a.v, b.v); }
+inline vmask operator >  (const vfloat & a, const vfloat & b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vmask operator >= (const vfloat & a, const vfloat & b) { return _mm_cmpge_ps(a.v, b.v); }
+inline vmask operator == (const vfloat & a, const vfloat & b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline vmask operator & (const vmask & a, const vmask & b) { return _mm_and_ps(a.v, b.v); }
+inline vmask operator | (const vmask & a, const vmask & b) { return _mm_or_ps(a.v, b.v); }
+inline vmask andnot(const vmask & a, const vmask & b) { return _mm_andnot_ps(b.v, a.v); } // a & ~b
+
+inline vfloat select(const vmask & m, const vfloat & a, const vfloat & b) { return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)); }
+
+inline float reduce_min(const vfloat & a)
+{
+    auto m = _mm_min_ps(a.v, _mm_movehl_ps(a.v, a.v));
+    return _mm_cvtss_f32(_mm_min_ss(m, _mm_shuffle_ps(m, m, 1)));
+}
+
+#endif
+
+// Lanewise 3D vector operations on structure-of-arrays data
+struct vfloat3 { vfloat x, y, z; };
+inline vfloat3 operator + (const vfloat3 & a, const vfloat3 & b) { return {a.x+b.x, a.y+b.y, a.z+b.z}; }
+inline vfloat3 operator - (const vfloat3 & a, const vfloat3 & b) { return {a.x-b.x, a.y-b.y, a.z-b.z}; }
+inline vfloat3 operator * (const vfloat3 & a, const vfloat & b) { return {a.x*b, a.y*b, a.z*b}; }
+inline vfloat3 cross(const vfloat3 & a, const vfloat3 & b) { return {a.y*b.z-a.z*b.y, a.z*b.x-a.x*b.z, a.x*b.y-a.y*b.x}; }
+inline vfloat dot(const vfloat3 & a, const vfloat3 & b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
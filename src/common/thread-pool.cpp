@@ -0,0 +1,124 @@
+#include "thread-pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threadCount) : queuedTasks(0), nextWorker(0), stopping(false)
+{
+    threadCount = std::max(threadCount, 1);
+    for(int i=0; i<threadCount; ++i) workers.push_back(std::unique_ptr<Worker>(new Worker));
+    for(int i=0; i<threadCount; ++i) threads.push_back(std::thread(&ThreadPool::WorkerMain, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeCondition.notify_all();
+    for(auto & thread : threads) thread.join();
+}
+
+int ThreadPool::GetCurrentWorker() const
+{
+    auto id = std::this_thread::get_id();
+    for(size_t i=0; i<threads.size(); ++i) if(threads[i].get_id() == id) return (int)i;
+    return -1;
+}
+
+bool ThreadPool::PopTask(int worker, Task & task)
+{
+    // Take the newest task from our own deque, if we have one
+    if(worker >= 0)
+    {
+        auto & own = *workers[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if(!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --queuedTasks;
+            return true;
+        }
+    }
+
+    // Otherwise steal the oldest task from another worker
+    int count = (int)workers.size();
+    for(int i=0; i<count; ++i)
+    {
+        auto & victim = *workers[(worker + 1 + i) % count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if(!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --queuedTasks;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::RunTask(Task & task)
+{
+    task.function();
+    if(--task.group->pending == 0)
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        doneCondition.notify_all();
+    }
+}
+
+void ThreadPool::WorkerMain(int worker)
+{
+    while(true)
+    {
+        Task task;
+        if(PopTask(worker, task))
+        {
+            RunTask(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeCondition.wait(lock, [this]() { return stopping || queuedTasks > 0; });
+        if(stopping) return;
+    }
+}
+
+void ThreadPool::Run(TaskGroup & group, std::function<void()> task)
+{
+    ++group.pending;
+
+    int worker = GetCurrentWorker();
+    if(worker < 0) worker = nextWorker++ % workers.size();
+    {
+        std::lock_guard<std::mutex> lock(workers[worker]->mutex);
+        workers[worker]->tasks.push_back({std::move(task), &group});
+        ++queuedTasks;
+    }
+
+    // Taking the lock ensures that a worker cannot miss the wakeup between checking queuedTasks and going to sleep
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    wakeCondition.notify_one();
+}
+
+void ThreadPool::Wait(TaskGroup & group)
+{
+    // Threads outside the pool simply sleep, so that the pool's thread count is the number of threads doing work
+    int worker = GetCurrentWorker();
+    if(worker < 0)
+    {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        doneCondition.wait(lock, [&group]() { return group.IsDone(); });
+        return;
+    }
+
+    // Workers must keep running tasks while they wait, as the tasks they are waiting on may be queued behind them
+    while(!group.IsDone())
+    {
+        Task task;
+        if(PopTask(worker, task)) RunTask(task);
+        else std::this_thread::yield();
+    }
+}
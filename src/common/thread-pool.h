@@ -0,0 +1,70 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counts the unfinished tasks submitted to a ThreadPool, so that a caller can wait on them as a group
+class TaskGroup
+{
+    friend class ThreadPool;
+    std::atomic<int> pending;
+
+    TaskGroup(const TaskGroup &); // Noncopyable
+public:
+    TaskGroup() : pending(0) {}
+
+    bool IsDone() const { return pending == 0; }
+};
+
+// Fixed set of worker threads, each owning a deque of tasks. Workers run their own most recently submitted tasks first,
+// and steal the oldest tasks from other workers when they run out, which keeps recursively spawned work local to a thread.
+class ThreadPool
+{
+    struct Task { std::function<void()> function; TaskGroup * group; };
+    struct Worker { std::mutex mutex; std::deque<Task> tasks; };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<int> queuedTasks;
+    std::atomic<unsigned> nextWorker;
+    std::mutex sleepMutex;
+    std::condition_variable wakeCondition, doneCondition;
+    bool stopping;
+
+    ThreadPool(const ThreadPool &); // Noncopyable
+
+    int GetCurrentWorker() const;
+    bool PopTask(int worker, Task & task);
+    void RunTask(Task & task);
+    void WorkerMain(int worker);
+public:
+    explicit ThreadPool(int threadCount = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    int GetThreadCount() const { return (int)threads.size(); }
+
+    // Queues a task on the calling worker if called from within the pool, otherwise distributes tasks across workers
+    void Run(TaskGroup & group, std::function<void()> task);
+
+    // Returns once every task in the group has finished. Workers run queued tasks while waiting, other threads sleep.
+    void Wait(TaskGroup & group);
+
+    // Calls body(begin, end) on consecutive ranges of at most grainSize indices covering [0, count), returning once every range is done
+    template<class F> void ParallelFor(int count, int grainSize, F body)
+    {
+        TaskGroup group;
+        for(int begin=0; begin<count; begin+=grainSize)
+        {
+            int end = std::min(begin+grainSize, count);
+            Run(group, [&body, begin, end]() { body(begin, end); });
+        }
+        Wait(group);
+    }
+};
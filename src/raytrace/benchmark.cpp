@@ -0,0 +1,312 @@
+#include "wavefront.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static const char * usage = "Usage: benchmark [-w width] [-h height] [-t max-threads] [-n runs] [-b max-bounces] [-o results.json] [kernel|animated|spheres|triangles|reflections|shadows[:count]]...";
+
+template<class F> double TimeSeconds(F function)
+{
+    auto t0 = std::chrono::high_resolution_clock::now();
+    function();
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+}
+
+// Compares IntersectRayTriangle, applied to each triangle in turn, against IntersectRayTriangles on the same triangles in SIMD batches
+void BenchmarkTriangleKernel()
+{
+    const int batchCount = 1024, rayCount = 4096;
+    std::mt19937 engine;
+    std::uniform_real_distribution<float> random(-1, 1);
+    auto randomPoint = [&]() { return float3(random(engine), random(engine), random(engine)); };
+
+    std::vector<float3> vertices;
+    std::vector<TriangleBatch> batches(batchCount);
+    for(auto & batch : batches)
+    {
+        for(int lane=0; lane<SIMD_WIDTH; ++lane)
+        {
+            auto center = randomPoint();
+            float3 v0 = center + randomPoint() * 0.5f, v1 = center + randomPoint() * 0.5f, v2 = center + randomPoint() * 0.5f;
+            vertices.insert(end(vertices), {v0, v1, v2});
+            batch.SetTriangle(lane, v0, v1, v2);
+        }
+    }
+
+    std::vector<Ray> rays;
+    for(int i=0; i<rayCount; ++i) rays.push_back({randomPoint() + float3(0,0,4), norm(randomPoint() * 0.25f + float3(0,0,-1))});
+
+    int scalarHits = 0, batchHits = 0, mismatches = 0;
+    std::vector<float> scalarTs(rayCount * batchCount), batchTs(rayCount * batchCount);
+    double scalarTime = TimeSeconds([&]()
+    {
+        for(int i=0; i<rayCount; ++i)
+        {
+            for(int j=0; j<batchCount; ++j)
+            {
+                float bestT = std::numeric_limits<float>::infinity(), t;
+                for(int lane=0; lane<SIMD_WIDTH; ++lane)
+                {
+                    auto * v = &vertices[(j*SIMD_WIDTH + lane)*3];
+                    if(IntersectRayTriangle(rays[i], v[0], v[1], v[2], &t) && t < bestT) bestT = t;
+                }
+                scalarTs[i*batchCount + j] = bestT;
+            }
+        }
+    });
+    double batchTime = TimeSeconds([&]()
+    {
+        for(int i=0; i<rayCount; ++i)
+        {
+            for(int j=0; j<batchCount; ++j)
+            {
+                float t = std::numeric_limits<float>::infinity();
+                IntersectRayTriangles(rays[i], batches[j], std::numeric_limits<float>::infinity(), &t);
+                batchTs[i*batchCount + j] = t;
+            }
+        }
+    });
+    for(size_t i=0; i<scalarTs.size(); ++i)
+    {
+        if(scalarTs[i] < std::numeric_limits<float>::infinity()) ++scalarHits;
+        if(batchTs[i] < std::numeric_limits<float>::infinity()) ++batchHits;
+        if(std::abs(scalarTs[i] - batchTs[i]) > 1e-4f && scalarTs[i] != batchTs[i]) ++mismatches;
+    }
+
+    double tests = (double)rayCount * batchCount * SIMD_WIDTH;
+    std::cout << "Ray-triangle kernel, " << SIMD_WIDTH << " triangles per batch:" << std::endl;
+    std::cout << "  scalar:  " << tests / scalarTime * 1e-6 << " M tests/s (" << scalarHits << " batch hits)" << std::endl;
+    std::cout << "  batched: " << tests / batchTime * 1e-6 << " M tests/s (" << batchHits << " batch hits, " << mismatches << " mismatches)" << std::endl;
+    std::cout << "  speedup: " << scalarTime / batchTime << "x" << std::endl;
+}
+
+// Animates two copies of a forest of size x size trees for two seconds at 60 frames per second, bringing the hierarchies of one up to date with
+// Scene::Update after each frame, and rebuilding those of the other with Scene::BuildBvh
+void BenchmarkAnimation(int size, int maxThreads)
+{
+    const int frames = 120;
+    ThreadPool pool(maxThreads);
+    auto updated = CreateForestScene(size), rebuilt = CreateForestScene(size);
+    updated.BuildBvh(&pool);
+    std::vector<double> updateSeconds, buildSeconds;
+    int rebuildCount = 0;
+    for(int frame=0; frame<frames; ++frame)
+    {
+        AnimateScene(updated, 1.0f/60);
+        AnimateScene(rebuilt, 1.0f/60);
+        float buildCost = updated.bvh.buildCost;
+        updateSeconds.push_back(TimeSeconds([&]() { updated.Update(); }));
+        if(updated.bvh.buildCost != buildCost) ++rebuildCount;
+        buildSeconds.push_back(TimeSeconds([&]() { rebuilt.BuildBvh(&pool); }));
+    }
+    std::sort(begin(updateSeconds), end(updateSeconds));
+    std::sort(begin(buildSeconds), end(buildSeconds));
+
+    std::cout << "animated:" << size << ", " << updated.instances.size() << " instances, " << frames << " frames:" << std::endl;
+    std::cout << "  Update:   median " << updateSeconds[frames/2] * 1000 << " ms, max " << updateSeconds.back() * 1000 << " ms, top level rebuilt " << rebuildCount << " times, "
+        << updated.bvh.GetCost() / rebuilt.bvh.GetCost() << "x the cost of a rebuilt top level" << std::endl;
+    std::cout << "  BuildBvh: median " << buildSeconds[frames/2] * 1000 << " ms, max " << buildSeconds.back() * 1000 << " ms on " << pool.GetThreadCount() << " threads" << std::endl;
+}
+
+struct SceneBenchmark
+{
+    const char * name;
+    int defaultCount;
+    std::function<Scene(int count)> create;
+};
+
+static const SceneBenchmark sceneBenchmarks[] = {
+    {"spheres", 1000, [](int count) { return CreateSpheresScene(count, 0); }},
+    {"triangles", 1000000, [](int count) { return CreateTrianglesScene(count); }},
+    {"reflections", 100, [](int count) { return CreateSpheresScene(count, 0.8f); }},
+    {"shadows", 100000, [](int count) { return CreateCanopyScene(count); }}
+};
+
+// Rays traced by one render, which are the same for every run of a scene, and the time spent on each kind, summed over every run
+struct ThreadResult
+{
+    int threadCount;
+    std::vector<double> seconds; // Of each run, sorted
+    int64_t primaryRays, reflectionRays, shadowRays;
+    double primarySeconds, reflectionSeconds, shadowSeconds;
+
+    double GetPercentile(int percent) const { return seconds[std::max((int)std::ceil(seconds.size() * percent / 100.0) - 1, 0)]; }
+    double GetRate(int64_t rays, double totalSeconds) const { return rays * seconds.size() / std::max(totalSeconds, 1e-9) * 1e-6; }
+};
+
+struct SceneResult
+{
+    std::string name;
+    int count;
+    size_t objectCount, triangleCount;
+    double buildSeconds;
+    std::vector<ThreadResult> threads; // Ordered by thread count, starting from one
+};
+
+// Renders a scene with the wavefront renderer, which times each kind of ray separately, on every thread count from one up to maxThreads. Each
+// thread count is run once to warm up before it is timed.
+static SceneResult BenchmarkScene(const SceneBenchmark & benchmark, int count, int2 dimensions, int maxThreads, int runs, int maxBounces)
+{
+    SceneResult result;
+    result.name = benchmark.name;
+    result.count = count;
+    auto scene = benchmark.create(count);
+    result.objectCount = scene.spheres.size() + scene.meshes.size() + scene.instances.size();
+    result.triangleCount = 0;
+    for(auto & mesh : scene.meshes) result.triangleCount += mesh.triangles.size();
+    for(auto & instance : scene.instances) result.triangleCount += instance.mesh->triangles.size();
+    {
+        ThreadPool pool(maxThreads);
+        result.buildSeconds = TimeSeconds([&]() { scene.BuildBvh(&pool); });
+    }
+
+    std::vector<int> threadCounts;
+    for(int threads=1; threads<maxThreads; threads*=2) threadCounts.push_back(threads);
+    threadCounts.push_back(maxThreads);
+
+    RaytracedImage image;
+    WavefrontRenderer renderer;
+    renderer.maxDepth = maxBounces;
+    for(int threads : threadCounts)
+    {
+        ThreadPool pool(threads);
+        ThreadResult thread = {threads};
+        for(int run=-1; run<runs; ++run)
+        {
+            double seconds = TimeSeconds([&]()
+            {
+                image.Reset(dimensions, Pose(), dimensions);
+                renderer.Render(scene, image, &pool);
+            });
+            if(run < 0) continue;
+            thread.seconds.push_back(seconds);
+            thread.primarySeconds += renderer.primarySeconds;
+            thread.reflectionSeconds += renderer.reflectionSeconds;
+            thread.shadowSeconds += renderer.shadowSeconds;
+        }
+        std::sort(begin(thread.seconds), end(thread.seconds));
+        thread.primaryRays = image.GetPixelCount();
+        thread.reflectionRays = renderer.pathRayCount - thread.primaryRays;
+        thread.shadowRays = renderer.shadowRayCount;
+        result.threads.push_back(thread);
+    }
+    return result;
+}
+
+static void PrintSceneResult(const SceneResult & result)
+{
+    std::cout << result.name << ":" << result.count << ", " << result.objectCount << " objects, " << result.triangleCount << " triangles, built in " << result.buildSeconds * 1000 << " ms" << std::endl;
+    for(auto & thread : result.threads)
+    {
+        std::cout << "  " << thread.threadCount << " threads: median " << thread.GetPercentile(50) * 1000 << " ms (min " << thread.seconds.front() * 1000 << ", p90 " << thread.GetPercentile(90) * 1000 << ", max " << thread.seconds.back() * 1000 << "), "
+            << "M rays/s " << thread.GetRate(thread.primaryRays, thread.primarySeconds) << " primary, " << thread.GetRate(thread.reflectionRays, thread.reflectionSeconds) << " reflection, " << thread.GetRate(thread.shadowRays, thread.shadowSeconds) << " shadow, "
+            << result.threads.front().GetPercentile(50) / thread.GetPercentile(50) << "x speedup" << std::endl;
+    }
+}
+
+static void SaveResults(const std::vector<SceneResult> & results, int2 dimensions, int runs, int maxBounces, const char * filename)
+{
+    std::ofstream out(filename);
+    if(!out) throw std::runtime_error(std::string("Cannot write ") + filename);
+    out << "{\n  \"simdWidth\": " << SIMD_WIDTH << ", \"width\": " << dimensions.x << ", \"height\": " << dimensions.y << ", \"runs\": " << runs << ", \"maxBounces\": " << maxBounces << ",\n  \"scenes\": [";
+    for(size_t i=0; i<results.size(); ++i)
+    {
+        auto & result = results[i];
+        out << (i ? "," : "") << "\n    {\n      \"name\": \"" << result.name << "\", \"count\": " << result.count << ", \"objects\": " << result.objectCount << ", \"triangles\": " << result.triangleCount << ", \"buildSeconds\": " << result.buildSeconds << ",\n      \"threads\": [";
+        for(size_t j=0; j<result.threads.size(); ++j)
+        {
+            auto & thread = result.threads[j];
+            out << (j ? "," : "") << "\n        {\"threads\": " << thread.threadCount
+                << ", \"seconds\": {\"min\": " << thread.seconds.front() << ", \"p50\": " << thread.GetPercentile(50) << ", \"p90\": " << thread.GetPercentile(90) << ", \"max\": " << thread.seconds.back() << "}"
+                << ", \"primaryRays\": " << thread.primaryRays << ", \"reflectionRays\": " << thread.reflectionRays << ", \"shadowRays\": " << thread.shadowRays
+                << ", \"primaryMraysPerSecond\": " << thread.GetRate(thread.primaryRays, thread.primarySeconds)
+                << ", \"reflectionMraysPerSecond\": " << thread.GetRate(thread.reflectionRays, thread.reflectionSeconds)
+                << ", \"shadowMraysPerSecond\": " << thread.GetRate(thread.shadowRays, thread.shadowSeconds)
+                << ", \"speedup\": " << result.threads.front().GetPercentile(50) / thread.GetPercentile(50) << "}";
+        }
+        out << "\n      ]\n    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char * argv[]) try
+{
+    int2 dimensions = {640,360};
+    int maxThreads = std::max((int)std::thread::hardware_concurrency(), 1), runs = 5, maxBounces = 4;
+    std::string output;
+    std::vector<std::string> names;
+    for(int i=1; i<argc; ++i)
+    {
+        if(strcmp(argv[i], "-o") == 0)
+        {
+            if(i+1 == argc) throw std::runtime_error(usage);
+            output = argv[++i];
+        }
+        else if(argv[i][0] == '-')
+        {
+            if(i+1 == argc) throw std::runtime_error(usage);
+            int value = atoi(argv[++i]);
+            if(strcmp(argv[i-1], "-b") == 0 && value >= 0) maxBounces = value;
+            else if(value <= 0) throw std::runtime_error(usage);
+            else if(strcmp(argv[i-1], "-w") == 0) dimensions.x = value;
+            else if(strcmp(argv[i-1], "-h") == 0) dimensions.y = value;
+            else if(strcmp(argv[i-1], "-t") == 0) maxThreads = value;
+            else if(strcmp(argv[i-1], "-n") == 0) runs = value;
+            else throw std::runtime_error(usage);
+        }
+        else names.push_back(argv[i]);
+    }
+    if(names.empty())
+    {
+        names.push_back("kernel");
+        names.push_back("animated");
+        for(auto & benchmark : sceneBenchmarks) names.push_back(benchmark.name);
+    }
+
+    // Scenes may be named with a count, as in spheres:10000, to measure how their cost grows. The count of the animated forest is its size.
+    std::vector<SceneResult> results;
+    for(auto & name : names)
+    {
+        if(name == "kernel")
+        {
+            BenchmarkTriangleKernel();
+            continue;
+        }
+        auto colon = name.find(':');
+        if(name.compare(0, colon, "animated") == 0)
+        {
+            int size = colon == std::string::npos ? 60 : atoi(name.c_str() + colon + 1);
+            if(size <= 0) throw std::runtime_error(usage);
+            BenchmarkAnimation(size, maxThreads);
+            continue;
+        }
+        auto benchmark = std::find_if(std::begin(sceneBenchmarks), std::end(sceneBenchmarks), [&](const SceneBenchmark & b) { return name.compare(0, colon, b.name) == 0; });
+        if(benchmark == std::end(sceneBenchmarks)) throw std::runtime_error(usage);
+        int count = colon == std::string::npos ? benchmark->defaultCount : atoi(name.c_str() + colon + 1);
+        if(count <= 0) throw std::runtime_error(usage);
+        results.push_back(BenchmarkScene(*benchmark, count, dimensions, maxThreads, runs, maxBounces));
+        PrintSceneResult(results.back());
+    }
+
+    if(!output.empty())
+    {
+        SaveResults(results, dimensions, runs, maxBounces, output.c_str());
+        std::cout << "Wrote " << output << std::endl;
+    }
+    return 0;
+}
+catch(const std::exception & e)
+{
+    std::cerr << e.what() << std::endl;
+    return -1;
+}
@@ -0,0 +1,238 @@
+#include "bvh.h"
+#include "thread-pool.h"
+#include <algorithm>
+
+namespace
+{
+    const int maxDepth = 48; // Keeps the traversal stack in Bvh::Traverse from overflowing
+    const float traversalCost = 1.0f, intersectionCost = 1.0f;
+    const int binCount = 32;                   // Candidate splits per axis, for nodes too large to try every split
+    const int sweepThreshold = 64;             // Nodes up to this size try every split, which costs little and finds better trees
+    const int taskThreshold = 4096;            // Smaller subtrees are built by the thread which split their parent
+    const int chunkSize = 16384;               // Nodes with more primitives than this are also binned in parallel, in chunks of this size
+
+    float GetAxis(const float3 & v, int axis) { return axis == 0 ? v.x : axis == 1 ? v.y : v.z; }
+
+    struct Bin
+    {
+        Bounds bounds;
+        int count;
+
+        Bin() : count() {}
+        void Include(const Bin & bin) { bounds.Include(bin.bounds); count += bin.count; }
+    };
+
+    struct BvhBuilder
+    {
+        const std::vector<Bounds> & primitives;
+        std::vector<float3> centers;
+        int maxLeafSize, batchSize;
+        ThreadPool * pool;
+        Bvh & bvh;
+        std::atomic<int> nodeCount;
+
+        BvhBuilder(const std::vector<Bounds> & primitives, int maxLeafSize, int batchSize, ThreadPool * pool, Bvh & bvh) : primitives(primitives), maxLeafSize(maxLeafSize), batchSize(batchSize), pool(pool), bvh(bvh), nodeCount(1) {}
+
+        // Leaves test their primitives in batches, so the cost of a leaf grows with its number of batches rather than primitives
+        float GetLeafCost(int count) const { return (float)((count + batchSize - 1) / batchSize); }
+
+        // Calls body(chunk, begin, end) over [first, first+count), in parallel if there is more than one chunk, and returns the number of chunks
+        template<class F> int ForEachChunk(int first, int count, F body)
+        {
+            if(!pool || count <= chunkSize)
+            {
+                body(0, first, first+count);
+                return 1;
+            }
+            pool->ParallelFor(count, chunkSize, [&](int begin, int end) { body(begin/chunkSize, first+begin, first+end); });
+            return (count + chunkSize - 1) / chunkSize;
+        }
+
+        void SortRange(int first, int count, int axis)
+        {
+            auto begin = bvh.indices.begin() + first;
+            std::sort(begin, begin + count, [&](int a, int b) { return GetAxis(centers[a], axis) < GetAxis(centers[b], axis); });
+        }
+
+        // Sweeps each axis in sorted order, evaluating the SAH cost of every possible partition, and leaves the range sorted along the best axis
+        void FindSweepSplit(int first, int count, int & bestAxis, int & bestSplit, float & bestCost)
+        {
+            float rightAreas[sweepThreshold];
+            for(int axis=0; axis<3; ++axis)
+            {
+                SortRange(first, count, axis);
+
+                Bounds right;
+                for(int i=count-1; i>0; --i)
+                {
+                    right.Include(primitives[bvh.indices[first+i]]);
+                    rightAreas[i] = right.GetSurfaceArea();
+                }
+
+                Bounds left;
+                for(int i=1; i<count; ++i)
+                {
+                    left.Include(primitives[bvh.indices[first+i-1]]);
+                    float cost = left.GetSurfaceArea() * GetLeafCost(i) + rightAreas[i] * GetLeafCost(count - i);
+                    if(cost < bestCost)
+                    {
+                        bestAxis = axis;
+                        bestSplit = i;
+                        bestCost = cost;
+                    }
+                }
+            }
+            if(bestAxis >= 0 && bestAxis != 2) SortRange(first, count, bestAxis);
+        }
+
+        // Sorts primitives into equal slices of the range of their centers along each axis, evaluates the SAH cost of splitting between each pair of
+        // slices, and partitions the range at the best split
+        void FindBinnedSplit(int first, int count, const Bounds & centerBounds, int & bestAxis, int & bestSplit, float & bestCost)
+        {
+            float offsets[3], scales[3];
+            bool splittable[3];
+            for(int axis=0; axis<3; ++axis)
+            {
+                offsets[axis] = GetAxis(centerBounds.min, axis);
+                scales[axis] = binCount / (GetAxis(centerBounds.max, axis) - offsets[axis]);
+                splittable[axis] = GetAxis(centerBounds.max, axis) > offsets[axis];
+            }
+            auto getBin = [&](int primitive, int axis) { return std::min((int)((GetAxis(centers[primitive], axis) - offsets[axis]) * scales[axis]), binCount-1); };
+
+            std::vector<Bin> chunkBins(((count + chunkSize - 1) / chunkSize) * 3 * binCount);
+            int chunks = ForEachChunk(first, count, [&](int chunk, int begin, int end)
+            {
+                auto bins = chunkBins.data() + chunk * 3 * binCount;
+                for(int i=begin; i<end; ++i)
+                {
+                    int primitive = bvh.indices[i];
+                    for(int axis=0; axis<3; ++axis)
+                    {
+                        if(!splittable[axis]) continue;
+                        auto & bin = bins[axis * binCount + getBin(primitive, axis)];
+                        bin.bounds.Include(primitives[primitive]);
+                        ++bin.count;
+                    }
+                }
+            });
+
+            int bestBin = 0;
+            for(int axis=0; axis<3; ++axis)
+            {
+                if(!splittable[axis]) continue;
+                Bin bins[binCount];
+                for(int chunk=0; chunk<chunks; ++chunk) for(int i=0; i<binCount; ++i) bins[i].Include(chunkBins[(chunk * 3 + axis) * binCount + i]);
+
+                float rightAreas[binCount];
+                Bin right;
+                for(int i=binCount-1; i>0; --i)
+                {
+                    right.Include(bins[i]);
+                    rightAreas[i] = right.bounds.GetSurfaceArea();
+                }
+
+                Bin left;
+                for(int i=1; i<binCount; ++i)
+                {
+                    left.Include(bins[i-1]);
+                    if(left.count == 0 || left.count == count) continue;
+                    float cost = left.bounds.GetSurfaceArea() * GetLeafCost(left.count) + rightAreas[i] * GetLeafCost(count - left.count);
+                    if(cost < bestCost)
+                    {
+                        bestAxis = axis;
+                        bestBin = i;
+                        bestSplit = left.count;
+                        bestCost = cost;
+                    }
+                }
+            }
+            if(bestAxis >= 0)
+            {
+                auto begin = bvh.indices.begin() + first;
+                std::partition(begin, begin + count, [&](int primitive) { return getBin(primitive, bestAxis) < bestBin; });
+            }
+        }
+
+        void BuildNode(int index, int first, int count, int depth)
+        {
+            std::vector<Bounds> chunkBounds(((count + chunkSize - 1) / chunkSize) * 2);
+            int chunks = ForEachChunk(first, count, [&](int chunk, int begin, int end)
+            {
+                for(int i=begin; i<end; ++i)
+                {
+                    chunkBounds[chunk*2].Include(primitives[bvh.indices[i]]);
+                    chunkBounds[chunk*2+1].Include(centers[bvh.indices[i]]);
+                }
+            });
+            Bounds bounds, centerBounds;
+            for(int chunk=0; chunk<chunks; ++chunk)
+            {
+                bounds.Include(chunkBounds[chunk*2]);
+                centerBounds.Include(chunkBounds[chunk*2+1]);
+            }
+            bvh.nodes[index] = {bounds, first, count};
+            if(count <= 1 || depth >= maxDepth) return;
+
+            int bestAxis = -1, bestSplit = 0;
+            float bestCost = std::numeric_limits<float>::infinity();
+            if(count <= sweepThreshold) FindSweepSplit(first, count, bestAxis, bestSplit, bestCost);
+            else FindBinnedSplit(first, count, centerBounds, bestAxis, bestSplit, bestCost);
+
+            float area = bounds.GetSurfaceArea();
+            float leafCost = area * GetLeafCost(count) * intersectionCost;
+            float splitCost = area * traversalCost + bestCost * intersectionCost;
+            if(count <= maxLeafSize && leafCost <= splitCost) return;
+
+            // Primitives whose centers coincide cannot be told apart, so are split evenly
+            if(bestAxis < 0) bestSplit = count / 2;
+
+            int child = nodeCount.fetch_add(2);
+            bvh.nodes[index].first = child;
+            bvh.nodes[index].count = 0;
+            if(pool && count > taskThreshold)
+            {
+                TaskGroup group;
+                pool->Run(group, [=]() { BuildNode(child, first, bestSplit, depth+1); });
+                BuildNode(child+1, first+bestSplit, count-bestSplit, depth+1);
+                pool->Wait(group);
+            }
+            else
+            {
+                BuildNode(child, first, bestSplit, depth+1);
+                BuildNode(child+1, first+bestSplit, count-bestSplit, depth+1);
+            }
+        }
+    };
+}
+
+void Bvh::Build(const std::vector<Bounds> & primitives, int maxLeafSize, int batchSize, ThreadPool * pool)
+{
+    // Primitives with empty bounds can never be hit, and are left out of the hierarchy
+    nodes.clear();
+    indices.clear();
+    buildCost = 0;
+    for(size_t i=0; i<primitives.size(); ++i) if(!primitives[i].IsEmpty()) indices.push_back((int)i);
+    if(indices.empty()) return;
+
+    BvhBuilder builder(primitives, maxLeafSize, batchSize, pool, *this);
+    builder.centers.resize(primitives.size());
+    builder.ForEachChunk(0, (int)primitives.size(), [&](int, int begin, int end)
+    {
+        for(int i=begin; i<end; ++i) builder.centers[i] = primitives[i].GetCenter();
+    });
+
+    // Children are allocated in pairs after their parent, and a binary tree has fewer than twice as many nodes as leaves
+    nodes.resize(indices.size() * 2);
+    builder.BuildNode(0, 0, (int)indices.size(), 0);
+    nodes.resize(builder.nodeCount);
+    buildCost = GetCost();
+}
+
+float Bvh::GetCost() const
+{
+    if(nodes.empty()) return 0;
+    float cost = 0;
+    for(auto & node : nodes) cost += node.bounds.GetSurfaceArea() * (node.IsLeaf() ? node.count * intersectionCost : traversalCost);
+    float rootArea = nodes[0].bounds.GetSurfaceArea();
+    return rootArea > 0 ? cost / rootArea : 0;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "geometry.h"
+#include "stats.h"
+#include <vector>
+
+class ThreadPool;
+
+struct BvhNode
+{
+    Bounds bounds;
+    int first, count; // Leaves cover indices [first, first+count), interior nodes have count == 0 and children at nodes first and first+1
+
+    bool IsLeaf() const { return count > 0; }
+};
+
+// Bounding volume hierarchy over an arbitrary set of primitives, built using the surface area heuristic
+struct Bvh
+{
+    std::vector<BvhNode> nodes;
+    std::vector<int> indices;
+    float buildCost; // GetCost() as built, before any refitting
+
+    Bvh() : buildCost() {}
+
+    // Primitives are assumed to be tested batchSize at a time within leaves, which the surface area heuristic accounts for. Large nodes choose among
+    // a fixed number of evenly spaced splits per axis, small ones among every split. If a pool is given, subtrees are built in parallel.
+    void Build(const std::vector<Bounds> & primitives, int maxLeafSize, int batchSize = 1, ThreadPool * pool = nullptr);
+
+    // Updates the bounds of every node after primitives have moved, keeping the structure of the tree, in one bottom-up pass. Leaf bounds are given by
+    // leafBounds(node). Children always follow their parents, so visiting nodes in reverse order reaches both children of a node before the node itself.
+    template<class F> void Refit(F leafBounds)
+    {
+        for(size_t i=nodes.size(); i--; )
+        {
+            auto & node = nodes[i];
+            if(node.IsLeaf()) node.bounds = leafBounds(node);
+            else
+            {
+                node.bounds = nodes[node.first].bounds;
+                node.bounds.Include(nodes[node.first+1].bounds);
+            }
+        }
+    }
+    void Refit(const std::vector<Bounds> & primitives)
+    {
+        Refit([&](const BvhNode & leaf)
+        {
+            Bounds bounds;
+            for(int i=leaf.first; i<leaf.first+leaf.count; ++i) bounds.Include(primitives[indices[i]]);
+            return bounds;
+        });
+    }
+
+    // Returns the expected cost of tracing a ray through the hierarchy by the surface area heuristic, in units of leaf entries. Refitting keeps
+    // the structure of a tree while its primitives move apart, so this grows relative to buildCost as refitted trees become worse than rebuilt ones.
+    float GetCost() const;
+
+    // Visits leaves hit by the ray in approximately front-to-back order. The leaf function is called as leaf(node, maxT),
+    // may reduce maxT to cull farther nodes, and returns true to end the traversal early, in which case Traverse returns true.
+    template<class F> bool Traverse(const Ray & ray, float maxT, F leaf) const
+    {
+        struct Entry { int node; float t; } stack[64];
+        int size = 0;
+
+        auto invDirection = float3(1,1,1) / ray.direction;
+        float t;
+        if(nodes.empty() || !IntersectRayBox(ray, invDirection, nodes[0].bounds, maxT, &t)) return false;
+        stack[size++] = {0,t};
+
+        while(size)
+        {
+            auto entry = stack[--size];
+            if(entry.t > maxT) continue;
+
+            auto & node = nodes[entry.node];
+            RAYTRACE_COUNT(NodeVisits, 1);
+            if(node.IsLeaf())
+            {
+                if(leaf(node, maxT)) return true;
+                continue;
+            }
+
+            float t0, t1;
+            bool hit0 = IntersectRayBox(ray, invDirection, nodes[node.first].bounds, maxT, &t0);
+            bool hit1 = IntersectRayBox(ray, invDirection, nodes[node.first+1].bounds, maxT, &t1);
+            if(hit0 && hit1)
+            {
+                // Push the farther child first, so that the nearer child is visited first
+                if(t0 < t1)
+                {
+                    stack[size++] = {node.first+1, t1};
+                    stack[size++] = {node.first, t0};
+                }
+                else
+                {
+                    stack[size++] = {node.first, t0};
+                    stack[size++] = {node.first+1, t1};
+                }
+            }
+            else if(hit0) stack[size++] = {node.first, t0};
+            else if(hit1) stack[size++] = {node.first+1, t1};
+        }
+        return false;
+    }
+
+    // Visits leaves hit by any ray of the packet in approximately front-to-back order. maxT holds one distance per ray, which the leaf function
+    // may reduce. The leaf function is called as leaf(node, mask) with the rays which hit the node, and returns the rays which need no further
+    // traversal. Traversal ends once every ray is finished, and TraversePacket returns the mask of finished rays.
+    template<class F> uint64_t TraversePacket(const RayPacket & packet, uint64_t mask, const float * maxT, F leaf) const
+    {
+        struct Entry { int node; uint64_t mask; } stack[64];
+        int size = 0;
+
+        float t;
+        if(nodes.empty() || !(mask = IntersectRaysBox(packet, mask, nodes[0].bounds, maxT, &t))) return 0;
+        stack[size++] = {0,mask};
+
+        uint64_t finished = 0;
+        while(size)
+        {
+            auto entry = stack[--size];
+            entry.mask &= ~finished;
+            if(!entry.mask) continue;
+
+            auto & node = nodes[entry.node];
+            RAYTRACE_COUNT(NodeVisits, 1);
+            if(node.IsLeaf())
+            {
+                finished |= leaf(node, entry.mask);
+                if(finished == mask) break;
+                continue;
+            }
+
+            float t0, t1;
+            auto mask0 = IntersectRaysBox(packet, entry.mask, nodes[node.first].bounds, maxT, &t0);
+            auto mask1 = IntersectRaysBox(packet, entry.mask, nodes[node.first+1].bounds, maxT, &t1);
+            if(mask0 && mask1)
+            {
+                // As in Traverse, the child which the packet enters first is visited first
+                if(t0 < t1)
+                {
+                    stack[size++] = {node.first+1, mask1};
+                    stack[size++] = {node.first, mask0};
+                }
+                else
+                {
+                    stack[size++] = {node.first, mask0};
+                    stack[size++] = {node.first+1, mask1};
+                }
+            }
+            else if(mask0) stack[size++] = {node.first, mask0};
+            else if(mask1) stack[size++] = {node.first+1, mask1};
+        }
+        return finished;
+    }
+};
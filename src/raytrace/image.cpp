@@ -0,0 +1,452 @@
+#include "image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+// Encoding follows the EXT_texture_shared_exponent specification, so that packed pixels could also be used directly as GL_RGB9_E5 texels
+enum { MantissaBits = 9, ExponentBias = 15, MaxExponent = 31 };
+
+uint32_t PackRGB9E5(const float3 & color)
+{
+    const float maxValue = std::ldexp((float)((1 << MantissaBits) - 1) / (1 << MantissaBits), MaxExponent - ExponentBias);
+    auto clamp = [maxValue](float x) { return x > 0 ? std::min(x, maxValue) : 0.0f; }; // Also maps NaN to zero
+    float r = clamp(color.x), g = clamp(color.y), b = clamp(color.z), maxComponent = std::max(std::max(r, g), b);
+
+    int exponent = -ExponentBias;
+    if(maxComponent > 0) std::frexp(maxComponent, &exponent); // maxComponent = m * 2^exponent, with m in [0.5,1)
+    exponent = std::max(exponent, -ExponentBias) + ExponentBias;
+    if((int)std::floor(maxComponent / std::ldexp(1.0f, exponent - ExponentBias - MantissaBits) + 0.5f) == 1 << MantissaBits) ++exponent;
+
+    float scale = std::ldexp(1.0f, MantissaBits + ExponentBias - exponent);
+    auto mantissa = [scale](float x) { return (uint32_t)std::floor(x * scale + 0.5f); };
+    return mantissa(r) | mantissa(g) << 9 | mantissa(b) << 18 | (uint32_t)exponent << 27;
+}
+
+float3 UnpackRGB9E5(uint32_t packed)
+{
+    float scale = std::ldexp(1.0f, (int)(packed >> 27) - ExponentBias - MantissaBits);
+    return float3((float)(packed & 511), (float)(packed >> 9 & 511), (float)(packed >> 18 & 511)) * scale;
+}
+
+// Maps linear values in [0,1], quantized to 12 bits, to 8-bit sRGB. 12 bits is enough that adjacent entries never differ by more than one.
+static struct SrgbTable
+{
+    enum { Size = 4096 };
+    uint8_t values[Size];
+
+    SrgbTable()
+    {
+        for(int i=0; i<Size; ++i)
+        {
+            double linear = (double)i / (Size - 1), srgb = linear <= 0.0031308 ? linear * 12.92 : 1.055 * std::pow(linear, 1/2.4) - 0.055;
+            values[i] = (uint8_t)(srgb * 255 + 0.5);
+        }
+    }
+} srgbTable;
+
+void ConvertLinearToSrgb8(const float * components, uint8_t * out, size_t count)
+{
+    size_t i = 0;
+    int indices[SIMD_WIDTH];
+    for(; i+SIMD_WIDTH <= count; i+=SIMD_WIDTH)
+    {
+        // max returns its second argument for NaN, so that NaNs become zero
+        (min(max(vfloat::Load(components + i), vfloat(0)), vfloat(1)) * vfloat(SrgbTable::Size - 1)).StoreRounded(indices);
+        for(int j=0; j<SIMD_WIDTH; ++j) out[i+j] = srgbTable.values[indices[j]];
+    }
+    for(; i<count; ++i)
+    {
+        float x = components[i] > 0 ? std::min(components[i], 1.0f) : 0.0f;
+        out[i] = srgbTable.values[(int)(x * (SrgbTable::Size - 1) + 0.5f)];
+    }
+}
+
+void ConvertLinearToUnorm8(const float * components, uint8_t * out, size_t count)
+{
+    size_t i = 0;
+    int values[SIMD_WIDTH];
+    for(; i+SIMD_WIDTH <= count; i+=SIMD_WIDTH)
+    {
+        (min(max(vfloat::Load(components + i), vfloat(0)), vfloat(1)) * vfloat(255)).StoreRounded(values);
+        for(int j=0; j<SIMD_WIDTH; ++j) out[i+j] = (uint8_t)values[j];
+    }
+    for(; i<count; ++i)
+    {
+        float x = components[i] > 0 ? std::min(components[i], 1.0f) : 0.0f;
+        out[i] = (uint8_t)(x * 255 + 0.5f);
+    }
+}
+
+// Maps costs from zero to scale logarithmically onto a ramp from black through blue, cyan, green, yellow and red to white. Colors are chosen for
+// display, so are written directly rather than converted from linear.
+static void ConvertCostsToSrgb8(const float * costs, float scale, uint8_t * out, size_t count)
+{
+    static const float3 ramp[] = {{0,0,0}, {0,0,1}, {0,1,1}, {0,1,0}, {1,1,0}, {1,0,0}, {1,1,1}};
+    const int last = sizeof(ramp) / sizeof(ramp[0]) - 1;
+    float normalize = last / std::log(1 + std::max(scale, 1.0f));
+    for(size_t i=0; i<count; ++i)
+    {
+        float position = std::min(std::log(1 + std::max(costs[i], 0.0f)) * normalize, (float)last);
+        int stop = std::min((int)position, last - 1);
+        auto color = ramp[stop] + (ramp[stop+1] - ramp[stop]) * (position - stop);
+        for(auto channel : {color.x, color.y, color.z}) *out++ = (uint8_t)(channel * 255 + 0.5f);
+    }
+}
+
+void RaytracedImage::ConvertToSrgb8(const Tile & tile, uint8_t * out, bool encodeSrgb) const
+{
+    int width = tile.max.x - tile.min.x;
+    auto convert = encodeSrgb ? ConvertLinearToSrgb8 : ConvertLinearToUnorm8;
+    if(recordCosts && !costs.empty())
+    {
+        for(int y=tile.min.y; y<tile.max.y; ++y, out += width*3) ConvertCostsToSrgb8(&costs[y * dimensions.x + tile.min.x], costScale, out, width);
+        return;
+    }
+    std::vector<float3> row(format == PixelFormat::Float ? 0 : width);
+    for(int y=tile.min.y; y<tile.max.y; ++y, out += width*3)
+    {
+        int first = y * dimensions.x + tile.min.x;
+        if(format == PixelFormat::Float) convert(&pixels[first].x, out, width*3);
+        else
+        {
+            for(int x=0; x<width; ++x) row[x] = GetPixel(first + x);
+            convert(&row[0].x, out, width*3);
+        }
+    }
+}
+
+static void CheckStream(const std::ofstream & out, const char * filename)
+{
+    if(!out) throw std::runtime_error(std::string("Unable to write ") + filename + ".");
+}
+
+void RaytracedImage::Reproject(const Pose & newViewPose)
+{
+    const float unknown = std::numeric_limits<float>::quiet_NaN(), infinity = std::numeric_limits<float>::infinity();
+    std::vector<float> oldDepths(depths.size(), unknown);
+    oldDepths.swap(depths);
+    auto oldPixels = pixels;
+    auto oldPackedPixels = packedPixels;
+    auto oldHits = primaryHits;
+    auto oldShadowed = primaryShadowed;
+    reused.assign(depths.size(), 0);
+
+    // Inverts the projection in GetPrimaryRay, where the old view pose is still in effect
+    auto halfDims = float2(dimensions - 1) * 0.5f;
+    auto aspectRatio = (float)dimensions.x / dimensions.y;
+    for(int y=0, i=0; y<dimensions.y; ++y)
+    {
+        for(int x=0; x<dimensions.x; ++x, ++i)
+        {
+            // Where nothing was hit, only the direction matters
+            if(std::isnan(oldDepths[i])) continue;
+            auto ray = GetPrimaryRay({x,y});
+            auto point = oldDepths[i] < infinity ? newViewPose.DetransformPoint(ray.origin + ray.direction * oldDepths[i]) : newViewPose.DetransformDirection(ray.direction);
+            if(point.z >= 0) continue;
+            int2 coord((int)std::floor(halfDims.x - point.x / point.z * halfDims.x / aspectRatio + 0.5f), (int)std::floor(halfDims.y + point.y / point.z * halfDims.y + 0.5f));
+            if(coord.x < 0 || coord.y < 0 || coord.x >= dimensions.x || coord.y >= dimensions.y) continue;
+
+            int j = coord.y * dimensions.x + coord.x;
+            float depth = oldDepths[i] < infinity ? mag(point) : infinity;
+            if(depth >= depths[j]) continue; // Never true while depths[j] is NaN
+            depths[j] = depth;
+            reused[j] = 1;
+            if(format == PixelFormat::RGB9E5) packedPixels[j] = oldPackedPixels[i];
+            else pixels[j] = oldPixels[i];
+            if(!primaryHits.empty())
+            {
+                primaryHits[j] = oldHits[i];
+                primaryShadowed[j] = oldShadowed[i];
+            }
+        }
+    }
+
+    // Splatting leaves gaps where surfaces are magnified, through which more distant surfaces may show, and rounds silhouettes to whole pixels. Retracing
+    // both sides of every marked change in depth covers both. One pixel in each 4x4 block is also retraced, in turn, so that none is reused for more than
+    // 16 reprojections in a row, which bounds how long view dependent shading such as highlights and reflections can lag behind.
+    int refreshIndex = reprojectionCount++ % 16;
+    for(int y=0, i=0; y<dimensions.y; ++y)
+    {
+        for(int x=0; x<dimensions.x; ++x, ++i)
+        {
+            if(!reused[i]) continue;
+            bool retrace = (x % 4) + (y % 4) * 4 == refreshIndex;
+            for(int ny=std::max(y-1, 0); ny<=std::min(y+1, dimensions.y-1); ++ny)
+            {
+                for(int nx=std::max(x-1, 0); nx<=std::min(x+1, dimensions.x-1); ++nx)
+                {
+                    float neighbor = depths[ny * dimensions.x + nx];
+                    retrace |= neighbor < depths[i] * 0.9f || neighbor * 0.9f > depths[i];
+                }
+            }
+            if(retrace) reused[i] = 2;
+        }
+    }
+    reusedPixelCount = 0;
+    for(size_t i=0; i<reused.size(); ++i)
+    {
+        if(reused[i] == 1) ++reusedPixelCount;
+        if(reused[i] != 2) continue;
+        reused[i] = 0;
+        depths[i] = unknown;
+    }
+}
+
+void RaytracedImage::RelightTile(const Scene & scene, const Tile & tile)
+{
+    if(relightShadows)
+    {
+        // The shadow rays of a tile are traced together, which lets the scene sort them into coherent packets
+        std::vector<Ray> rays;
+        std::vector<const Material *> ignore;
+        std::vector<int> indices;
+        for(int y=tile.min.y; y<tile.max.y; ++y)
+        {
+            for(int x=tile.min.x; x<tile.max.x; ++x)
+            {
+                int index = y * dimensions.x + x;
+                auto & hit = primaryHits[index];
+                if(!hit.IsHit()) continue;
+                rays.push_back({hit.point, scene.dirLight.direction});
+                ignore.push_back(hit.material);
+                indices.push_back(index);
+            }
+        }
+        std::vector<uint64_t> occluded((rays.size() + 63) / 64);
+        if(!rays.empty()) scene.CheckOcclusionStream(rays.data(), ignore.data(), rays.size(), occluded.data());
+        for(size_t i=0; i<indices.size(); ++i) primaryShadowed[indices[i]] = occluded[i/64] >> (i%64) & 1;
+    }
+
+    for(int y=tile.min.y; y<tile.max.y; ++y)
+    {
+        for(int x=tile.min.x; x<tile.max.x; ++x)
+        {
+            int index = y * dimensions.x + x;
+            auto & hit = primaryHits[index];
+            SetPixel(index, hit.IsHit() ? scene.ComputeLighting(hit, viewPose.position, primaryShadowed[index] != 0) : scene.skyColor);
+        }
+    }
+}
+
+// Luminance of a color clamped to [0,1], as brighter colors cannot be told apart once displayed
+static float GetDisplayedLuminance(const float3 & color)
+{
+    return std::min(color.x, 1.0f) * 0.2126f + std::min(color.y, 1.0f) * 0.7152f + std::min(color.z, 1.0f) * 0.0722f;
+}
+
+// Surfaces seen through neighboring pixels belong to different objects, or to different faces of one object, if their materials differ, if their
+// distances differ as much as Reproject treats as a discontinuity, or if their normals differ by more than about 25 degrees. Hits do not record which
+// primitive was hit, so this stands in for comparing primitive ids.
+static bool IsGeometricEdge(const Hit & a, const Hit & b)
+{
+    if(a.IsHit() != b.IsHit()) return true;
+    if(!a.IsHit()) return false;
+    return a.material != b.material || a.distance < b.distance * 0.9f || a.distance * 0.9f > b.distance || dot(a.normal, b.normal) < 0.9f;
+}
+
+// Returns a value in [0,1) hashed from a pixel index and sample number, so that jitter does not depend on which thread traces the pixel
+static float GetJitter(uint32_t pixel, uint32_t sample)
+{
+    uint32_t hash = pixel * 0x9E3779B9u ^ (sample + 1) * 0x85EBCA6Bu;
+    hash ^= hash >> 16; hash *= 0x7FEB352Du;
+    hash ^= hash >> 15; hash *= 0x846CA68Bu;
+    hash ^= hash >> 16;
+    return (hash >> 8) * (1.0f / (1 << 24));
+}
+
+int RaytracedImage::Antialias(const Scene & scene, ThreadPool * pool, const AntialiasSettings & settings)
+{
+    int gridSize = settings.gridSize, sampleCount = gridSize * gridSize;
+    if(gridSize < 1 || sampleCount > RayPacket::MaxSize) throw std::runtime_error("Antialiasing grid size must be between 1 and 8.");
+    if(!IsComplete() || cancelled) return 0;
+
+    // Pixels are chosen by the largest difference in luminance across their 3x3 neighborhood, which need only be a quarter as large where the
+    // neighborhood spans a geometric edge
+    std::vector<float> luminance(GetPixelCount()), contrast(GetPixelCount());
+    for(int i=0; i<GetPixelCount(); ++i) luminance[i] = GetDisplayedLuminance(GetPixel(i));
+    std::vector<int> chosen;
+    for(int y=0, i=0; y<dimensions.y; ++y)
+    {
+        for(int x=0; x<dimensions.x; ++x, ++i)
+        {
+            float low = luminance[i], high = luminance[i];
+            bool edge = false;
+            for(int ny=std::max(y-1, 0); ny<=std::min(y+1, dimensions.y-1); ++ny)
+            {
+                for(int nx=std::max(x-1, 0); nx<=std::min(x+1, dimensions.x-1); ++nx)
+                {
+                    int neighbor = ny * dimensions.x + nx;
+                    low = std::min(low, luminance[neighbor]);
+                    high = std::max(high, luminance[neighbor]);
+                    if(!primaryHits.empty()) edge |= IsGeometricEdge(primaryHits[i], primaryHits[neighbor]);
+                }
+            }
+            contrast[i] = high - low;
+            if(contrast[i] > (edge ? settings.contrastThreshold / 4 : settings.contrastThreshold)) chosen.push_back(i);
+        }
+    }
+
+    // Every chosen pixel is given the same number of samples, so if the budget cannot cover them all, those of highest contrast are kept, then
+    // returned to image order so that neighboring pixels are traced together
+    size_t maxPixels = (size_t)(std::max(settings.sampleBudget, 0.0f) * GetPixelCount() / sampleCount);
+    if(chosen.size() > maxPixels)
+    {
+        std::nth_element(begin(chosen), begin(chosen) + maxPixels, end(chosen), [&contrast](int a, int b) { return contrast[a] > contrast[b]; });
+        chosen.resize(maxPixels);
+        std::sort(begin(chosen), end(chosen));
+    }
+
+    // Each sample is jittered within its cell of a grid over the pixel, and the samples are averaged with equal weight. Neighbors have already been
+    // compared, so pixels may be replaced as they are traced.
+    auto traceRange = [&](int begin, int end)
+    {
+        for(int i=begin; i<end && !cancelled; ++i)
+        {
+            auto work = recordCosts ? GetThreadWork() : 0;
+            int index = chosen[i];
+            float2 center = {(float)(index % dimensions.x), (float)(index / dimensions.x)};
+            Ray rays[RayPacket::MaxSize];
+            for(int s=0; s<sampleCount; ++s)
+            {
+                rays[s] = GetSampleRay(center + float2((s % gridSize + GetJitter(index, s*2)) / gridSize - 0.5f, (s / gridSize + GetJitter(index, s*2+1)) / gridSize - 0.5f));
+            }
+            float3 sum;
+            if(packetSize > 1)
+            {
+                RayPacket primary;
+                for(int s=0; s<sampleCount; ++s) primary.AddRay(rays[s]);
+                Hit hits[RayPacket::MaxSize];
+                float3 colors[RayPacket::MaxSize];
+                TracePacket(scene, primary, hits, colors);
+                for(int s=0; s<sampleCount; ++s) sum += colors[s];
+            }
+            else for(int s=0; s<sampleCount; ++s)
+            {
+                auto & ray = rays[s];
+                auto hit = scene.Intersect(ray);
+                bool shadowed = hit.IsHit() && scene.CheckOcclusion({hit.point, scene.dirLight.direction}, hit.material);
+                sum += hit.IsHit() ? scene.ComputeLighting(hit, ray.origin, shadowed) : scene.skyColor;
+            }
+            SetPixel(index, sum / (float)sampleCount);
+            if(recordCosts) costs[index] += (float)(GetThreadWork() - work);
+        }
+    };
+    if(pool) pool->ParallelFor((int)chosen.size(), 64, traceRange);
+    else traceRange(0, (int)chosen.size());
+    if(cancelled) return (int)chosen.size();
+
+    // Tiles of the final pass cover the whole image, so are reported as finished again
+    for(auto & tile : tiles) if(tile.step == 1 && onTileFinished) onTileFinished(tile);
+    return (int)chosen.size();
+}
+
+void RaytracedImage::SavePFM(const char * filename) const
+{
+    // A negative scale indicates little-endian data, and rows are stored from the bottom of the image to the top
+    std::ofstream out(filename, std::ofstream::binary);
+    CheckStream(out, filename);
+    out << "PF\n" << dimensions.x << " " << dimensions.y << "\n-1.0\n";
+    std::vector<float3> row(dimensions.x);
+    for(int y=dimensions.y-1; y>=0; --y)
+    {
+        for(int x=0; x<dimensions.x; ++x) row[x] = GetPixel(y * dimensions.x + x);
+        out.write(reinterpret_cast<const char *>(row.data()), sizeof(float3) * dimensions.x);
+    }
+    CheckStream(out, filename);
+}
+
+void RaytracedImage::SavePPM(const char * filename) const
+{
+    std::vector<uint8_t> bytes;
+    for(int i=0; i<GetPixelCount(); ++i)
+    {
+        auto pixel = GetPixel(i);
+        for(auto channel : {pixel.x, pixel.y, pixel.z}) bytes.push_back((uint8_t)(std::min(std::max(channel, 0.0f), 1.0f) * 255 + 0.5f));
+    }
+
+    std::ofstream out(filename, std::ofstream::binary);
+    CheckStream(out, filename);
+    out << "P6\n" << dimensions.x << " " << dimensions.y << "\n255\n";
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    CheckStream(out, filename);
+}
+
+void RaytracedImage::SaveCostsPFM(const char * filename) const
+{
+    if(costs.empty()) throw std::runtime_error("No costs were recorded for " + std::string(filename) + ".");
+    std::ofstream out(filename, std::ofstream::binary);
+    CheckStream(out, filename);
+    out << "Pf\n" << dimensions.x << " " << dimensions.y << "\n-1.0\n";
+    for(int y=dimensions.y-1; y>=0; --y) out.write(reinterpret_cast<const char *>(&costs[y * dimensions.x]), sizeof(float) * dimensions.x);
+    CheckStream(out, filename);
+}
+
+void RaytracedImage::SaveCostsPPM(const char * filename) const
+{
+    if(costs.empty()) throw std::runtime_error("No costs were recorded for " + std::string(filename) + ".");
+    std::vector<uint8_t> bytes(costs.size() * 3);
+    ConvertCostsToSrgb8(costs.data(), costScale, bytes.data(), costs.size());
+
+    std::ofstream out(filename, std::ofstream::binary);
+    CheckStream(out, filename);
+    out << "P6\n" << dimensions.x << " " << dimensions.y << "\n255\n";
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    CheckStream(out, filename);
+}
+
+void RaytracedImage::LoadPFM(const char * filename)
+{
+    std::ifstream in(filename, std::ifstream::binary);
+    if(!in) throw std::runtime_error(std::string("Unable to read ") + filename + ".");
+    std::string magic;
+    int2 size;
+    float scale;
+    in >> magic >> size.x >> size.y >> scale;
+    in.get();
+    if(!in || magic != "PF" || size.x <= 0 || size.y <= 0 || scale == 0) throw std::runtime_error(std::string(filename) + " is not an RGB Portable Float Map.");
+
+    Cancel();
+    format = PixelFormat::Float;
+    dimensions = size;
+    viewPose = Pose();
+    std::vector<uint32_t>().swap(packedPixels);
+    pixels.resize(GetPixelCount());
+    for(int y=dimensions.y-1; y>=0; --y) in.read(reinterpret_cast<char *>(&pixels[y * dimensions.x]), sizeof(float3) * dimensions.x);
+    if(!in) throw std::runtime_error(std::string(filename) + " is truncated.");
+
+    // Big-endian files are swapped on little-endian machines, which are all this renderer runs on
+    if(scale > 0)
+    {
+        auto words = reinterpret_cast<uint32_t *>(pixels.data());
+        for(size_t i=0; i<pixels.size()*3; ++i) words[i] = words[i] >> 24 | (words[i] >> 8 & 0xFF00) | (words[i] << 8 & 0xFF0000) | words[i] << 24;
+    }
+    std::vector<float>().swap(depths);
+    std::vector<uint8_t>().swap(reused);
+    std::vector<Hit>().swap(primaryHits);
+    std::vector<uint8_t>().swap(primaryShadowed);
+    std::vector<float>().swap(costs);
+    CreateTiles(dimensions);
+    MarkComplete();
+}
+
+ImageDifference CompareImages(const RaytracedImage & a, const RaytracedImage & b, float tolerance)
+{
+    if(a.dimensions != b.dimensions) throw std::runtime_error("Images of different dimensions cannot be compared.");
+    ImageDifference difference = {};
+    double sumSquares = 0;
+    for(int i=0; i<a.GetPixelCount(); ++i)
+    {
+        // NaN compares false with everything, so is counted as failing rather than slipping under the tolerance
+        auto error = a.GetPixel(i) - b.GetPixel(i);
+        float pixelError = std::max(std::max(std::abs(error.x), std::abs(error.y)), std::abs(error.z));
+        difference.maxError = std::max(difference.maxError, pixelError);
+        if(!(pixelError <= tolerance)) ++difference.failingPixels;
+        sumSquares += dot(error, error);
+    }
+    difference.rmse = (float)std::sqrt(sumSquares / std::max(a.GetPixelCount() * 3, 1));
+    return difference;
+}
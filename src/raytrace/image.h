@@ -0,0 +1,396 @@
+#pragma once
+
+#include "raytrace.h"
+#include "thread-pool.h"
+
+struct Tile
+{
+    int2 min, max;
+    int step; // Only every step-th pixel in each direction is traced, and its color fills the step x step block it begins
+};
+
+// Packs a color into 32 bits as three 9-bit mantissas sharing a 5-bit exponent, clamping negative components to zero
+uint32_t PackRGB9E5(const float3 & color);
+float3 UnpackRGB9E5(uint32_t packed);
+
+// Converts linear color components to 8-bit sRGB, clamping them to [0,1]
+void ConvertLinearToSrgb8(const float * components, uint8_t * out, size_t count);
+
+// Quantizes linear color components to 8 bits without encoding them, clamping them to [0,1], for textures which cannot decode sRGB
+void ConvertLinearToUnorm8(const float * components, uint8_t * out, size_t count);
+
+enum class PixelFormat { Float, RGB9E5 };
+
+// Controls RaytracedImage::Antialias
+struct AntialiasSettings
+{
+    int gridSize;            // Pixels chosen for supersampling are traced again with gridSize x gridSize stratified samples, up to RayPacket::MaxSize in all
+    float contrastThreshold; // Pixels are chosen where luminance, clamped to [0,1], varies by more than this across their 3x3 neighborhood, or by a quarter of it at geometric edges
+    float sampleBudget;      // Samples allowed per pixel of the image on average, beyond the first. If more pixels are chosen, those of highest contrast are supersampled.
+
+    AntialiasSettings() : gridSize(4), contrastThreshold(0.05f), sampleBudget(1) {}
+};
+
+// The pixels of one tile converted to 8-bit sRGB, with rows tightly packed
+struct ConvertedTile
+{
+    Tile tile;
+    std::vector<uint8_t> pixels;
+};
+
+struct RaytracedImage
+{
+    PixelFormat format;                 // Storage used for pixels from the next call to Reset
+    std::vector<float3> pixels;         // Used by PixelFormat::Float
+    std::vector<uint32_t> packedPixels; // Used by PixelFormat::RGB9E5, at a quarter of the size
+    std::vector<float> depths;          // Distance along each primary ray to the surface it hit, infinity if it hit nothing, or NaN if unknown. Kept only if reprojection is set.
+    std::vector<uint8_t> reused;        // Nonzero for pixels reprojected from the previous image, which are not traced
+    std::vector<Hit> primaryHits;       // Surface seen through each pixel, kept only if keepHits is set
+    std::vector<uint8_t> primaryShadowed; // Nonzero where the shadow ray from the surface in primaryHits is occluded
+    std::vector<float> costs;           // Work done tracing each pixel, as counted by GetThreadWork, kept only if recordCosts is set. Zero for reprojected pixels.
+    int2 dimensions;
+    Pose viewPose;
+
+    std::vector<Tile> tiles;
+    std::atomic<int> nextTile, finishedTileCount;
+    std::function<void(const Tile &)> onTileFinished; // If set, called on the tracing thread as each tile is finished
+
+    ThreadPool * pool;
+    TaskGroup tileTasks;
+    std::atomic<bool> cancelled;
+
+    int packetSize; // Primary and shadow rays are traced in packets covering packetSize x packetSize pixels, or one at a time if packetSize is 1
+    int coarsestStep; // Step of the first pass over the image, set by Reset
+    bool reprojection; // If set, Reset keeps the pixels of the previous image whose surfaces are still visible from the new view pose, and only the rest are traced
+    int reprojectionCount, reusedPixelCount;
+    bool keepHits; // If set, Reset keeps the surface seen through each pixel, so that ResetLighting can shade the image again without tracing primary rays
+    bool relighting, relightShadows; // Set by ResetLighting, and cleared by Reset
+    bool recordCosts; // If set, Reset keeps the cost of each pixel, and ConvertToSrgb8 shows costs as a heatmap in place of colors. Requires RAYTRACE_STATS.
+    float costScale;  // Cost shown at the hot end of the heatmap, which is logarithmic, so that both cheap and pathological pixels stand out
+
+    RaytracedImage() : format(PixelFormat::Float), nextTile(0), finishedTileCount(0), pool(), cancelled(false), packetSize(1), coarsestStep(1), reprojection(false), reprojectionCount(0), reusedPixelCount(0),
+        keepHits(false), relighting(false), relightShadows(false), recordCosts(false), costScale(256) {}
+    ~RaytracedImage() { Cancel(); }
+
+    bool IsComplete() const { return finishedTileCount == (int)tiles.size(); }
+    bool HasCompleteHits() const { return !primaryHits.empty() && (relighting || IsComplete()); } // Relighting requires that every pixel was traced
+
+    int GetPixelCount() const { return dimensions.x * dimensions.y; }
+    float3 GetPixel(int index) const { return format == PixelFormat::RGB9E5 ? UnpackRGB9E5(packedPixels[index]) : pixels[index]; }
+    void SetPixel(int index, const float3 & color)
+    {
+        if(format == PixelFormat::RGB9E5) packedPixels[index] = PackRGB9E5(color);
+        else pixels[index] = color;
+    }
+
+    // Writes the pixels of a tile to out as 8-bit sRGB, or as linear 8-bit values if encodeSrgb is false, with rows tightly packed, or their costs
+    // as a heatmap if recordCosts is set
+    void ConvertToSrgb8(const Tile & tile, uint8_t * out, bool encodeSrgb = true) const;
+    ConvertedTile ConvertToSrgb8(const Tile & tile, bool encodeSrgb = true) const
+    {
+        ConvertedTile converted = {tile, std::vector<uint8_t>((tile.max.x - tile.min.x) * (tile.max.y - tile.min.y) * 3)};
+        ConvertToSrgb8(tile, converted.pixels.data(), encodeSrgb);
+        return converted;
+    }
+
+    // Returns once every tile queued by RaytraceParallel has been traced
+    void Wait()
+    {
+        if(pool) pool->Wait(tileTasks);
+    }
+
+    // Stops any parallel rendering, returning once no thread is writing to the image. Other threads may set cancelled to
+    // abandon the remaining tiles of a parallel render without waiting, which lasts until the next call to Cancel or Reset.
+    void Cancel()
+    {
+        cancelled = true;
+        if(pool) pool->Wait(tileTasks);
+        pool = nullptr;
+        cancelled = false;
+    }
+
+    // Splats every pixel of known depth at its position as seen from the new view pose, keeping the nearest surface where several land on one pixel.
+    // Pixels nothing lands on keep their previous color until traced, as do pixels which are marked to be traced again for other reasons.
+    void Reproject(const Pose & newViewPose);
+
+    // Prepares to trace the image in tiles of the given size. If coarsestStep is a power of two greater than one, the image is traced progressively: a first
+    // pass over the whole image traces every coarsestStep-th pixel, and each later pass halves the step and traces only the pixels not yet traced.
+    void Reset(const int2 & dimensions, const Pose & viewPose, int2 tileSize, int coarsestStep = 1)
+    {
+        Cancel();
+        size_t pixelCount = dimensions.x * dimensions.y;
+        if(reprojection && dimensions == this->dimensions && depths.size() == pixelCount && (format == PixelFormat::RGB9E5 ? packedPixels.size() : pixels.size()) == pixelCount
+            && keepHits == (primaryHits.size() == pixelCount))
+        {
+            Reproject(viewPose);
+        }
+        else
+        {
+            if(format == PixelFormat::RGB9E5)
+            {
+                std::vector<float3>().swap(pixels);
+                packedPixels.assign(pixelCount, 0);
+            }
+            else
+            {
+                std::vector<uint32_t>().swap(packedPixels);
+                pixels.assign(pixelCount, float3());
+            }
+            std::vector<uint8_t>().swap(reused);
+            reusedPixelCount = 0;
+            if(reprojection) depths.assign(pixelCount, std::numeric_limits<float>::quiet_NaN());
+            else std::vector<float>().swap(depths);
+            if(keepHits)
+            {
+                primaryHits.assign(pixelCount, Hit());
+                primaryShadowed.assign(pixelCount, 0);
+            }
+            else
+            {
+                std::vector<Hit>().swap(primaryHits);
+                std::vector<uint8_t>().swap(primaryShadowed);
+            }
+        }
+        if(recordCosts) costs.assign(pixelCount, 0);
+        else std::vector<float>().swap(costs);
+        this->dimensions = dimensions;
+        this->viewPose = viewPose;
+        this->coarsestStep = coarsestStep;
+        relighting = relightShadows = false;
+        CreateTiles(tileSize);
+    }
+
+    // Prepares to shade the image again from the surfaces kept by a previous complete render, after lights or materials have changed, without tracing
+    // primary rays. Shadow rays are traced again if traceShadows is set, or if a previous call which set it was not completed. Reflections are always
+    // traced again. Requires HasCompleteHits().
+    void ResetLighting(int2 tileSize, bool traceShadows)
+    {
+        Cancel();
+        relightShadows = traceShadows || (relighting && relightShadows && !IsComplete());
+        relighting = true;
+        coarsestStep = 1;
+        CreateTiles(tileSize);
+    }
+
+    // Divides the image into tiles for every pass from coarsestStep down, none of which have been traced
+    void CreateTiles(int2 tileSize)
+    {
+        // Tiles must begin on coarse pixels, so that every block of a pass lies within one tile
+        tileSize = (tileSize + coarsestStep - 1) / coarsestStep * coarsestStep;
+        tiles.clear();
+        for(int step=coarsestStep; step>=1; step/=2)
+        {
+            for(int y=0; y<dimensions.y; y+=tileSize.y)
+            {
+                for(int x=0; x<dimensions.x; x+=tileSize.x)
+                {
+                    tiles.push_back({{x,y}, {std::min(x+tileSize.x, dimensions.x), std::min(y+tileSize.y, dimensions.y)}, step});
+                }
+            }
+        }
+        nextTile = 0;
+        finishedTileCount = 0;
+    }
+
+    // Returns the ray through the center of a pixel, or through any position of the image, where pixel centers lie on whole coordinates
+    Ray GetPrimaryRay(const int2 & coord) const { return GetSampleRay(float2(coord)); }
+    Ray GetSampleRay(const float2 & position) const
+    {
+        auto halfDims = float2(dimensions - 1) * 0.5f;
+        auto aspectRatio = (float)dimensions.x / dimensions.y;
+        auto viewDirection = norm(float3((position.x-halfDims.x)*aspectRatio/halfDims.x, (halfDims.y-position.y)/halfDims.y, -1));
+        return viewPose * Ray{{0,0,0}, viewDirection};
+    }
+
+    // Pixels traced by an earlier pass with twice the step, or reprojected from the previous image, are not traced again
+    bool IsTracedInPass(const int2 & coord, int step) const
+    {
+        if(!reused.empty() && reused[coord.y * dimensions.x + coord.x]) return false;
+        return step == coarsestStep || coord.x % (step*2) != 0 || coord.y % (step*2) != 0;
+    }
+
+    // Sets the step x step block of pixels beginning at coord, clipped to the image, except for reprojected pixels. Only the pixel at coord was actually
+    // traced, so only it is given a depth and a primary hit.
+    void FillBlock(const int2 & coord, int step, const float3 & color, const Hit & hit, bool shadowed)
+    {
+        for(int y=coord.y; y<std::min(coord.y+step, dimensions.y); ++y)
+        {
+            for(int x=coord.x; x<std::min(coord.x+step, dimensions.x); ++x)
+            {
+                int index = y * dimensions.x + x;
+                if(reused.empty() || !reused[index]) SetPixel(index, color);
+            }
+        }
+        int index = coord.y * dimensions.x + coord.x;
+        if(!depths.empty()) depths[index] = hit.distance;
+        if(!primaryHits.empty())
+        {
+            primaryHits[index] = hit;
+            primaryShadowed[index] = shadowed;
+        }
+    }
+
+    // Sets the cost of the step x step block of pixels beginning at coord, clipped to the image, except for reprojected pixels
+    void FillCosts(const int2 & coord, int step, float cost)
+    {
+        for(int y=coord.y; y<std::min(coord.y+step, dimensions.y); ++y)
+        {
+            for(int x=coord.x; x<std::min(coord.x+step, dimensions.x); ++x)
+            {
+                int index = y * dimensions.x + x;
+                if(reused.empty() || !reused[index]) costs[index] = cost;
+            }
+        }
+    }
+
+    void RaytracePixel(const Scene & scene, const int2 & coord, int step = 1)
+    {
+        auto work = recordCosts ? GetThreadWork() : 0;
+        auto ray = GetPrimaryRay(coord);
+        auto hit = scene.Intersect(ray);
+        bool shadowed = hit.IsHit() && scene.CheckOcclusion({hit.point, scene.dirLight.direction}, hit.material);
+        FillBlock(coord, step, hit.IsHit() ? scene.ComputeLighting(hit, ray.origin, shadowed) : scene.skyColor, hit, shadowed);
+        if(recordCosts) FillCosts(coord, step, (float)(GetThreadWork() - work));
+    }
+
+    // Traces a packet of primary rays, followed by one packet of shadow rays for those which hit something, and shades each ray. Reflections are not
+    // coherent enough to benefit from packets, and are traced one ray at a time. Returns a mask of the rays whose surfaces are shadowed.
+    static uint64_t TracePacket(const Scene & scene, const RayPacket & primary, Hit * hits, float3 * colors)
+    {
+        RayPacket shadow;
+        scene.IntersectPacket(primary, nullptr, hits);
+
+        int shadowLanes[RayPacket::MaxSize];
+        const Material * shadowIgnore[RayPacket::MaxSize];
+        for(int i=0; i<primary.size; ++i)
+        {
+            if(!hits[i].IsHit()) continue;
+            shadowLanes[shadow.size] = i;
+            shadowIgnore[shadow.size] = hits[i].material;
+            shadow.AddRay({hits[i].point, scene.dirLight.direction});
+        }
+        auto occluded = shadow.size ? scene.CheckOcclusionPacket(shadow, shadowIgnore) : 0;
+        uint64_t shadowed = 0;
+        for(int i=0; i<shadow.size; ++i) if(occluded >> i & 1) shadowed |= 1ull << shadowLanes[i];
+
+        for(int i=0; i<primary.size; ++i) colors[i] = hits[i].IsHit() ? scene.ComputeLighting(hits[i], primary.GetRay(i).origin, (shadowed >> i & 1) != 0) : scene.skyColor;
+        return shadowed;
+    }
+
+    // Traces the pixels of a pass in [min, max) as one packet, with TracePacket. Work shared by a packet cannot be attributed to its rays, so each
+    // pixel is given an equal share of the cost of the block.
+    void RaytraceBlock(const Scene & scene, const int2 & min, const int2 & max, int step = 1)
+    {
+        auto work = recordCosts ? GetThreadWork() : 0;
+        RayPacket primary;
+        int2 coords[RayPacket::MaxSize];
+        for(int y=min.y; y<max.y; y+=step)
+        {
+            for(int x=min.x; x<max.x; x+=step)
+            {
+                if(!IsTracedInPass({x,y}, step)) continue;
+                coords[primary.size] = {x,y};
+                primary.AddRay(GetPrimaryRay({x,y}));
+            }
+        }
+        if(!primary.size) return;
+        Hit hits[RayPacket::MaxSize];
+        float3 colors[RayPacket::MaxSize];
+        auto shadowed = TracePacket(scene, primary, hits, colors);
+        for(int i=0; i<primary.size; ++i) FillBlock(coords[i], step, colors[i], hits[i], (shadowed >> i & 1) != 0);
+        if(recordCosts)
+        {
+            float cost = (float)(GetThreadWork() - work) / primary.size;
+            for(int i=0; i<primary.size; ++i) FillCosts(coords[i], step, cost);
+        }
+    }
+
+    // Shades the pixels of a tile from primaryHits, for ResetLighting
+    void RelightTile(const Scene & scene, const Tile & tile);
+
+    void RaytraceTile(const Scene & scene, const Tile & tile)
+    {
+        if(relighting) RelightTile(scene, tile);
+        else if(packetSize > 1)
+        {
+            int blockSize = packetSize * tile.step;
+            for(int y=tile.min.y; y<tile.max.y; y+=blockSize)
+            {
+                for(int x=tile.min.x; x<tile.max.x; x+=blockSize)
+                {
+                    RaytraceBlock(scene, {x,y}, {std::min(x+blockSize, tile.max.x), std::min(y+blockSize, tile.max.y)}, tile.step);
+                }
+            }
+        }
+        else for(int y=tile.min.y; y<tile.max.y; y+=tile.step)
+        {
+            for(int x=tile.min.x; x<tile.max.x; x+=tile.step)
+            {
+                if(IsTracedInPass({x,y}, tile.step)) RaytracePixel(scene, {x,y}, tile.step);
+            }
+        }
+
+        if(onTileFinished) onTileFinished(tile);
+        ++finishedTileCount;
+    }
+
+    // Traces the next unclaimed tile on the calling thread
+    void RaytraceNextTile(const Scene & scene)
+    {
+        int index = nextTile++;
+        if(index < (int)tiles.size()) RaytraceTile(scene, tiles[index]);
+    }
+
+    // Traces all remaining tiles on the thread pool, returning immediately
+    void RaytraceParallel(const Scene & scene, ThreadPool & pool)
+    {
+        this->pool = &pool;
+        for(size_t i=nextTile; i<tiles.size(); ++i)
+        {
+            pool.Run(tileTasks, [this, &scene]()
+            {
+                if(!cancelled) RaytraceNextTile(scene);
+            });
+        }
+    }
+
+    // Once the image is complete, traces pixels on edges and of high contrast again with several stratified samples each, chosen from the colors of
+    // neighboring pixels, and from their primary hits if keepHits is set, so that edges are antialiased at a fraction of the cost of supersampling
+    // every pixel. Primary hits and depths still describe the center of each pixel. Samples are traced on the pool if one is given, and tracing
+    // stops early if cancelled is set. Returns the number of pixels supersampled. Throws std::runtime_error if the grid size is out of range.
+    int Antialias(const Scene & scene, ThreadPool * pool, const AntialiasSettings & settings);
+
+    // Records every tile as finished, for renderers which fill in the pixels by other means, and which do not provide primary hits
+    void MarkComplete()
+    {
+        std::vector<Hit>().swap(primaryHits);
+        std::vector<uint8_t>().swap(primaryShadowed);
+        if(onTileFinished) for(auto & tile : tiles) onTileFinished(tile);
+        nextTile = finishedTileCount = (int)tiles.size();
+    }
+
+    // Writes the image as a little-endian floating point Portable Float Map
+    void SavePFM(const char * filename) const;
+
+    // Writes the image as an 8-bit binary Portable Pixmap, clamping color values to [0,1]
+    void SavePPM(const char * filename) const;
+
+    // Writes the costs recorded with recordCosts, either as a greyscale Portable Float Map holding the raw costs, or as the heatmap shown by
+    // ConvertToSrgb8 in an 8-bit Portable Pixmap
+    void SaveCostsPFM(const char * filename) const;
+    void SaveCostsPPM(const char * filename) const;
+
+    // Replaces the image with the pixels of a Portable Float Map, as a complete image of PixelFormat::Float traced from the default pose. Throws
+    // std::runtime_error if the file cannot be read.
+    void LoadPFM(const char * filename);
+};
+
+// Differences between two images of the same dimensions, where the error of a pixel is the largest difference between its channels
+struct ImageDifference
+{
+    float maxError;
+    float rmse;        // Over every channel of every pixel
+    int failingPixels; // Pixels whose error exceeds the tolerance, or is NaN
+};
+
+ImageDifference CompareImages(const RaytracedImage & a, const RaytracedImage & b, float tolerance); // Throws std::runtime_error if the dimensions differ
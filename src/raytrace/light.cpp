@@ -10,9 +10,14 @@ float3 DirectionalLight::ComputeContribution(const Hit & hit, const float3 & eye
 }
 
 float3 Scene::ComputeLighting(const Hit & hit, const float3 & viewPosition) const
+{
+    return ComputeLighting(hit, viewPosition, CheckOcclusion({hit.point, dirLight.direction}, hit.material));
+}
+
+float3 Scene::ComputeLighting(const Hit & hit, const float3 & viewPosition, bool occluded) const
 {
     auto light = hit.material->albedo * ambientLight;
-    if(!CheckOcclusion({hit.point, dirLight.direction}, hit.material))
+    if(!occluded)
     {
         auto eyeDir = norm(viewPosition - hit.point);
         light += dirLight.ComputeContribution(hit, eyeDir);
@@ -0,0 +1,496 @@
+#include "mesh-loader.h"
+#include "mapped-file.h"
+#include "thread-pool.h"
+
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    const size_t objChunkSize = 1 << 20; // Bytes of text per chunk, before extending it to the end of its last line
+    const size_t plyChunkSize = 1 << 16; // Vertices or faces per chunk
+
+    template<class F> void ForEachChunk(size_t chunkCount, ThreadPool * pool, F body)
+    {
+        if(pool) pool->ParallelFor((int)chunkCount, 1, [&](int begin, int end) { for(int i=begin; i<end; ++i) body(i); });
+        else for(size_t i=0; i<chunkCount; ++i) body((int)i);
+    }
+
+    bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+    double GetPowerOfTen(int exponent)
+    {
+        static const double powers[] = {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+        return exponent >= 0 && exponent <= 22 ? powers[exponent] : std::pow(10.0, exponent);
+    }
+
+    // Reads one line of text at a time, without ever reading past the end of the mapped file, which is not null terminated. Numbers are parsed
+    // directly rather than through the C library, which would require a terminator, and whose parsing depends on the locale.
+    struct TextCursor
+    {
+        const char * position, * end;
+
+        bool IsAtSpace() const { return position < end && (*position == ' ' || *position == '\t' || *position == '\r'); }
+        bool IsAtLineEnd() const { return position == end || *position == '\n' || *position == '#'; }
+        void SkipSpaces() { while(IsAtSpace()) ++position; }
+        void SkipToken() { while(!IsAtLineEnd() && !IsAtSpace()) ++position; }
+        void SkipLine()
+        {
+            while(position < end && *position != '\n') ++position;
+            if(position < end) ++position;
+        }
+
+        bool ParseSign()
+        {
+            bool negative = position < end && *position == '-';
+            if(position < end && (*position == '-' || *position == '+')) ++position;
+            return negative;
+        }
+
+        bool ParseInt(int & value)
+        {
+            bool negative = ParseSign();
+            if(position == end || !IsDigit(*position)) return false;
+            long long magnitude = 0;
+            for(; position < end && IsDigit(*position); ++position) magnitude = std::min(magnitude * 10 + (*position - '0'), (long long)INT_MAX);
+            value = (int)(negative ? -magnitude : magnitude);
+            return true;
+        }
+
+        bool ParseFloat(float & value)
+        {
+            SkipSpaces();
+            bool negative = ParseSign(), hasDigits = false;
+            double mantissa = 0;
+            int exponent = 0;
+            for(; position < end && IsDigit(*position); ++position, hasDigits = true) mantissa = mantissa * 10 + (*position - '0');
+            if(position < end && *position == '.')
+            {
+                for(++position; position < end && IsDigit(*position); ++position, hasDigits = true, --exponent) mantissa = mantissa * 10 + (*position - '0');
+            }
+            if(!hasDigits) return false;
+            if(position < end && (*position == 'e' || *position == 'E'))
+            {
+                ++position;
+                int power;
+                if(!ParseInt(power)) return false;
+                exponent += std::max(std::min(power, 1000), -1000);
+            }
+            mantissa = exponent >= 0 ? mantissa * GetPowerOfTen(exponent) : mantissa / GetPowerOfTen(-exponent);
+            value = (float)(negative ? -mantissa : mantissa);
+            return true;
+        }
+    };
+
+    // A range of whole lines of an OBJ file, which is counted and then parsed independently of the others
+    struct ObjChunk
+    {
+        const char * begin, * end;
+        int vertexCount, triangleCount; // Counted by the first pass
+        int firstVertex, firstTriangle; // Where the chunk's vertices and triangles are written by the second pass
+        bool malformed;
+    };
+
+    // Skips the keyword of a vertex or face statement, returning 'v' or 'f', or returns 0 for any other statement
+    char ReadObjStatement(TextCursor & cursor)
+    {
+        cursor.SkipSpaces();
+        if(cursor.end - cursor.position < 2) return 0;
+        char keyword = cursor.position[0], next = cursor.position[1];
+        if((keyword != 'v' && keyword != 'f') || (next != ' ' && next != '\t')) return 0;
+        cursor.position += 2;
+        return keyword;
+    }
+
+    void CountObjChunk(ObjChunk & chunk)
+    {
+        TextCursor cursor = {chunk.begin, chunk.end};
+        while(cursor.position < cursor.end)
+        {
+            char statement = ReadObjStatement(cursor);
+            if(statement == 'v') ++chunk.vertexCount;
+            if(statement == 'f')
+            {
+                int corners = 0;
+                for(cursor.SkipSpaces(); !cursor.IsAtLineEnd(); cursor.SkipSpaces(), ++corners) cursor.SkipToken();
+                chunk.triangleCount += std::max(corners - 2, 0);
+            }
+            cursor.SkipLine();
+        }
+    }
+
+    void ParseObjChunk(ObjChunk & chunk, int vertexCount, float3 * vertices, int3 * triangles)
+    {
+        TextCursor cursor = {chunk.begin, chunk.end};
+        int vertex = chunk.firstVertex, triangle = chunk.firstTriangle;
+        while(cursor.position < cursor.end)
+        {
+            char statement = ReadObjStatement(cursor);
+            if(statement == 'v')
+            {
+                auto & v = vertices[vertex++];
+                if(!cursor.ParseFloat(v.x) || !cursor.ParseFloat(v.y) || !cursor.ParseFloat(v.z)) chunk.malformed = true;
+            }
+            if(statement == 'f')
+            {
+                // Indices count from 1, or back from the latest vertex if negative, and may be followed by texture coordinate and normal indices
+                int corners = 0, first = 0, previous = 0;
+                for(cursor.SkipSpaces(); !cursor.IsAtLineEnd(); cursor.SkipSpaces(), ++corners)
+                {
+                    int index = 0;
+                    if(!cursor.ParseInt(index) || index == 0) chunk.malformed = true;
+                    index = index > 0 ? index - 1 : vertex + index;
+                    if(index < 0 || index >= vertexCount) chunk.malformed = true;
+                    cursor.SkipToken();
+
+                    if(corners == 0) first = index;
+                    else if(corners >= 2) triangles[triangle++] = {first, previous, index};
+                    previous = index;
+                }
+            }
+            cursor.SkipLine();
+        }
+    }
+
+    void LoadObj(const MappedFile & file, const char * filename, ThreadPool * pool, std::vector<float3> & vertices, std::vector<int3> & triangles)
+    {
+        // Chunks end at line breaks, so that no statement is split between two of them
+        auto text = reinterpret_cast<const char *>(file.GetData()), end = text + file.GetSize();
+        std::vector<ObjChunk> chunks;
+        for(auto begin = text; begin < end; )
+        {
+            auto chunkEnd = std::find(begin + std::min(objChunkSize, (size_t)(end - begin)) - 1, end, '\n');
+            if(chunkEnd < end) ++chunkEnd;
+            ObjChunk chunk = {begin, chunkEnd};
+            chunks.push_back(chunk);
+            begin = chunkEnd;
+        }
+
+        ForEachChunk(chunks.size(), pool, [&](int i) { CountObjChunk(chunks[i]); });
+        int vertexCount = 0, triangleCount = 0;
+        for(auto & chunk : chunks)
+        {
+            chunk.firstVertex = vertexCount;
+            chunk.firstTriangle = triangleCount;
+            vertexCount += chunk.vertexCount;
+            triangleCount += chunk.triangleCount;
+        }
+
+        vertices.resize(vertexCount);
+        triangles.resize(triangleCount);
+        ForEachChunk(chunks.size(), pool, [&](int i) { ParseObjChunk(chunks[i], vertexCount, vertices.data(), triangles.data()); });
+        for(auto & chunk : chunks) if(chunk.malformed) throw std::runtime_error(std::string(filename) + " contains a malformed vertex, or a face referring to a missing vertex.");
+    }
+
+    enum class PlyType { Int8, Uint8, Int16, Uint16, Int32, Uint32, Float32, Float64 };
+
+    struct PlyProperty
+    {
+        std::string name;
+        PlyType type;
+        bool isList;
+        PlyType countType; // Lists hold a count of this type, followed by that many values of type
+    };
+
+    struct PlyElement
+    {
+        std::string name;
+        size_t count;
+        std::vector<PlyProperty> properties;
+    };
+
+    // Faces whose lists of vertices vary in length can only be found by reading every face before them, so the first pass records where each
+    // chunk of faces starts, and how many triangles precede it
+    struct PlyFaceChunk
+    {
+        const uint8_t * begin;
+        size_t firstFace, firstTriangle;
+        bool malformed;
+    };
+
+    size_t GetPlySize(PlyType type)
+    {
+        static const size_t sizes[] = {1,1,2,2,4,4,4,8};
+        return sizes[(int)type];
+    }
+
+    bool ParsePlyType(const std::string & name, PlyType & type)
+    {
+        static const char * names[][2] = {{"char","int8"}, {"uchar","uint8"}, {"short","int16"}, {"ushort","uint16"}, {"int","int32"}, {"uint","uint32"}, {"float","float32"}, {"double","float64"}};
+        for(int i=0; i<8; ++i)
+        {
+            if(name != names[i][0] && name != names[i][1]) continue;
+            type = (PlyType)i;
+            return true;
+        }
+        return false;
+    }
+
+    // Values are assumed to be little-endian in memory, as they are on every platform this project targets
+    template<class T> double ReadPlyValue(const uint8_t * data, bool swapBytes)
+    {
+        uint8_t bytes[sizeof(T)];
+        memcpy(bytes, data, sizeof(T));
+        if(swapBytes) std::reverse(bytes, bytes + sizeof(T));
+        T value;
+        memcpy(&value, bytes, sizeof(T));
+        return (double)value;
+    }
+
+    double ReadPlyValue(const uint8_t * data, PlyType type, bool swapBytes)
+    {
+        switch(type)
+        {
+        case PlyType::Int8: return ReadPlyValue<int8_t>(data, swapBytes);
+        case PlyType::Uint8: return ReadPlyValue<uint8_t>(data, swapBytes);
+        case PlyType::Int16: return ReadPlyValue<int16_t>(data, swapBytes);
+        case PlyType::Uint16: return ReadPlyValue<uint16_t>(data, swapBytes);
+        case PlyType::Int32: return ReadPlyValue<int32_t>(data, swapBytes);
+        case PlyType::Uint32: return ReadPlyValue<uint32_t>(data, swapBytes);
+        case PlyType::Float32: return ReadPlyValue<float>(data, swapBytes);
+        default: return ReadPlyValue<double>(data, swapBytes);
+        }
+    }
+
+    class PlyFile
+    {
+        const char * filename;
+        const uint8_t * body, * end;
+        bool swapBytes;
+        std::vector<PlyElement> elements;
+
+        std::runtime_error Error(const char * problem) const { return std::runtime_error(std::string(filename) + " " + problem); }
+
+        // Returns the end of one item of an element, which may contain lists
+        const uint8_t * SkipItem(const uint8_t * position, const PlyElement & element, size_t * listLength = nullptr, const PlyProperty * list = nullptr) const
+        {
+            for(auto & property : element.properties)
+            {
+                size_t count = 1;
+                if(property.isList)
+                {
+                    if(GetPlySize(property.countType) > (size_t)(end - position)) throw Error("is truncated.");
+                    count = (size_t)ReadPlyValue(position, property.countType, swapBytes);
+                    position += GetPlySize(property.countType);
+                    if(&property == list) *listLength = count;
+                }
+                if(count > (size_t)(end - position) / GetPlySize(property.type)) throw Error("is truncated.");
+                position += count * GetPlySize(property.type);
+            }
+            return position;
+        }
+
+        const PlyProperty * FindProperty(const PlyElement & element, const char * name, size_t * offset) const
+        {
+            *offset = 0;
+            for(auto & property : element.properties)
+            {
+                if(property.name == name) return &property;
+                *offset += GetPlySize(property.type);
+            }
+            return nullptr;
+        }
+        // Most meshes have the same number of corners on every face, so that faces can be found from their index without reading every face before
+        // them. Checks this in parallel, and if so, advances position past the faces and divides them into chunks.
+        bool FindUniformFaces(ThreadPool * pool, const uint8_t *& position, const PlyElement & element, const PlyProperty & list, size_t listOffset, std::vector<PlyFaceChunk> & chunks, size_t & triangleCount) const
+        {
+            size_t stride = 0;
+            for(auto & property : element.properties) if(!property.isList) stride += GetPlySize(property.type);
+            for(auto & property : element.properties) if(property.isList && &property != &list) return false;
+            if(element.count == 0 || listOffset + GetPlySize(list.countType) > (size_t)(end - position)) return false;
+
+            auto corners = (size_t)ReadPlyValue(position + listOffset, list.countType, swapBytes);
+            stride += GetPlySize(list.countType) + corners * GetPlySize(list.type);
+            if(element.count > (size_t)(end - position) / stride) return false;
+
+            std::vector<char> uniform((element.count + plyChunkSize - 1) / plyChunkSize, 1);
+            ForEachChunk(uniform.size(), pool, [&](int chunk)
+            {
+                size_t first = chunk * plyChunkSize, last = std::min(first + plyChunkSize, element.count);
+                for(size_t i=first; i<last; ++i) if((size_t)ReadPlyValue(position + i * stride + listOffset, list.countType, swapBytes) != corners) uniform[chunk] = 0;
+            });
+            if(std::find(uniform.begin(), uniform.end(), 0) != uniform.end()) return false;
+
+            size_t trianglesPerFace = corners > 2 ? corners - 2 : 0;
+            for(size_t i=0; i<element.count; i+=plyChunkSize)
+            {
+                PlyFaceChunk chunk = {position + i * stride, i, i * trianglesPerFace, false};
+                chunks.push_back(chunk);
+            }
+            triangleCount = element.count * trianglesPerFace;
+            position += element.count * stride;
+            return true;
+        }
+    public:
+        PlyFile(const MappedFile & file, const char * filename) : filename(filename), end(file.GetData() + file.GetSize()), swapBytes(false)
+        {
+            auto text = reinterpret_cast<const char *>(file.GetData());
+            auto headerEnd = std::search(text, reinterpret_cast<const char *>(end), "end_header", "end_header" + 10);
+            headerEnd = std::find(headerEnd, reinterpret_cast<const char *>(end), '\n');
+            if(headerEnd == reinterpret_cast<const char *>(end)) throw Error("is not a PLY file.");
+            body = reinterpret_cast<const uint8_t *>(headerEnd + 1);
+
+            std::istringstream header(std::string(text, headerEnd));
+            std::string line, keyword;
+            if(!std::getline(header, line) || line.compare(0, 3, "ply") != 0) throw Error("is not a PLY file.");
+            while(std::getline(header, line))
+            {
+                std::istringstream words(line);
+                if(!(words >> keyword)) continue;
+                if(keyword == "format")
+                {
+                    std::string format;
+                    words >> format;
+                    if(format == "binary_big_endian") swapBytes = true;
+                    else if(format != "binary_little_endian") throw Error("is not a binary PLY file.");
+                }
+                else if(keyword == "element")
+                {
+                    PlyElement element;
+                    if(!(words >> element.name >> element.count)) throw Error("has a malformed element.");
+                    elements.push_back(element);
+                }
+                else if(keyword == "property")
+                {
+                    PlyProperty property = {};
+                    std::string type, countType;
+                    if(!(words >> type) || elements.empty()) throw Error("has a malformed property.");
+                    if(type == "list")
+                    {
+                        property.isList = true;
+                        if(!(words >> countType >> type) || !ParsePlyType(countType, property.countType)) throw Error("has a malformed property.");
+                    }
+                    if(!(words >> property.name) || !ParsePlyType(type, property.type)) throw Error("has a malformed property.");
+                    elements.back().properties.push_back(property);
+                }
+            }
+        }
+
+        void Load(ThreadPool * pool, std::vector<float3> & vertices, std::vector<int3> & triangles) const
+        {
+            const PlyElement * vertexElement = nullptr, * faceElement = nullptr;
+            const PlyProperty * indexList = nullptr;
+            const uint8_t * vertexData = nullptr;
+            size_t vertexStride = 0, triangleCount = 0;
+            std::vector<PlyFaceChunk> faceChunks;
+            const uint8_t * position = body;
+            for(auto & element : elements)
+            {
+                if(element.name == "vertex" && !vertexElement)
+                {
+                    vertexElement = &element;
+                    vertexData = position;
+                    for(auto & property : element.properties)
+                    {
+                        if(property.isList) throw Error("has vertices of varying size.");
+                        vertexStride += GetPlySize(property.type);
+                    }
+                    if(vertexStride && element.count > (size_t)(end - position) / vertexStride) throw Error("is truncated.");
+                    position += element.count * vertexStride;
+                }
+                else if(element.name == "face" && !faceElement)
+                {
+                    faceElement = &element;
+                    size_t offset;
+                    auto list = FindProperty(element, "vertex_indices", &offset);
+                    if(!list) list = FindProperty(element, "vertex_index", &offset);
+                    if(!list || !list->isList) throw Error("has faces without a list of vertex indices.");
+                    indexList = list;
+                    if(FindUniformFaces(pool, position, element, *list, offset, faceChunks, triangleCount)) continue;
+                    for(size_t i=0; i<element.count; ++i)
+                    {
+                        if(i % plyChunkSize == 0)
+                        {
+                            PlyFaceChunk chunk = {position, i, triangleCount, false};
+                            faceChunks.push_back(chunk);
+                        }
+                        size_t corners = 0;
+                        position = SkipItem(position, element, &corners, list);
+                        triangleCount += corners > 2 ? corners - 2 : 0;
+                    }
+                }
+                else for(size_t i=0; i<element.count; ++i) position = SkipItem(position, element);
+            }
+            if(!vertexElement) throw Error("has no vertices.");
+
+            size_t offsets[3];
+            const PlyProperty * coordinates[3] = {FindProperty(*vertexElement, "x", &offsets[0]), FindProperty(*vertexElement, "y", &offsets[1]), FindProperty(*vertexElement, "z", &offsets[2])};
+            if(!coordinates[0] || !coordinates[1] || !coordinates[2]) throw Error("has vertices without x, y and z coordinates.");
+
+            vertices.resize(vertexElement->count);
+            ForEachChunk((vertices.size() + plyChunkSize - 1) / plyChunkSize, pool, [&](int chunk)
+            {
+                size_t first = chunk * plyChunkSize, last = std::min(first + plyChunkSize, vertices.size());
+                for(size_t i=first; i<last; ++i)
+                {
+                    auto vertex = vertexData + i * vertexStride;
+                    vertices[i].x = (float)ReadPlyValue(vertex + offsets[0], coordinates[0]->type, swapBytes);
+                    vertices[i].y = (float)ReadPlyValue(vertex + offsets[1], coordinates[1]->type, swapBytes);
+                    vertices[i].z = (float)ReadPlyValue(vertex + offsets[2], coordinates[2]->type, swapBytes);
+                }
+            });
+
+            triangles.resize(triangleCount);
+            if(!faceElement) return;
+            ForEachChunk(faceChunks.size(), pool, [&](int index)
+            {
+                auto & chunk = faceChunks[index];
+                auto face = chunk.begin;
+                size_t triangle = chunk.firstTriangle, lastFace = std::min(chunk.firstFace + plyChunkSize, faceElement->count);
+                for(size_t i=chunk.firstFace; i<lastFace; ++i)
+                {
+                    int first = 0, previous = 0;
+                    size_t corners = 0;
+                    for(auto & property : faceElement->properties)
+                    {
+                        size_t count = 1;
+                        if(property.isList)
+                        {
+                            count = (size_t)ReadPlyValue(face, property.countType, swapBytes);
+                            face += GetPlySize(property.countType);
+                        }
+                        if(&property == indexList)
+                        {
+                            for(corners=0; corners<count; ++corners)
+                            {
+                                double value = ReadPlyValue(face + corners * GetPlySize(property.type), property.type, swapBytes);
+                                bool valid = value >= 0 && value < (double)vertices.size();
+                                int index = valid ? (int)value : 0;
+                                chunk.malformed |= !valid;
+                                if(corners == 0) first = index;
+                                else if(corners >= 2) triangles[triangle++] = {first, previous, index};
+                                previous = index;
+                            }
+                        }
+                        face += count * GetPlySize(property.type);
+                    }
+                }
+            });
+            for(auto & chunk : faceChunks) if(chunk.malformed) throw Error("has a face referring to a missing vertex.");
+        }
+    };
+}
+
+void LoadMesh(Mesh & mesh, const char * filename, ThreadPool * pool)
+{
+    std::string name = filename;
+    auto extension = name.substr(std::min(name.rfind('.'), name.size()));
+    std::transform(begin(extension), end(extension), begin(extension), ::tolower);
+    if(extension != ".obj" && extension != ".ply") throw std::runtime_error(name + " is neither an OBJ nor a PLY file.");
+
+    // Parsed into new arrays, so that the mesh is unchanged if the file turns out to be malformed
+    MappedFile file(filename);
+    std::vector<float3> vertices;
+    std::vector<int3> triangles;
+    if(extension == ".obj") LoadObj(file, filename, pool, vertices, triangles);
+    else PlyFile(file, filename).Load(pool, vertices, triangles);
+
+    mesh.vertices.swap(vertices);
+    mesh.triangles.swap(triangles);
+    mesh.dirty = true;
+}
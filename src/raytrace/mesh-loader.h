@@ -0,0 +1,9 @@
+#pragma once
+
+#include "raytrace.h"
+
+// Replaces the vertices and triangles of a mesh with those of a Wavefront OBJ or binary PLY file, chosen by its extension, and marks the mesh dirty.
+// Polygons are split into triangle fans, and every other attribute is ignored. The file is mapped into memory and counted before it is parsed, so
+// that the arrays are allocated once, and with a pool, both passes run in parallel over chunks of the file. Throws std::runtime_error if the file
+// cannot be read, or is malformed.
+void LoadMesh(Mesh & mesh, const char * filename, ThreadPool * pool = nullptr);
@@ -0,0 +1,349 @@
+#include "raytrace.h"
+#include "paged-mesh.h"
+
+// Tests the rays in mask against one lane of a triangle batch, returning the rays which hit it nearer than their entry in maxT, and storing their distances in outT
+static uint64_t IntersectRaysTriangle(const RayPacket & packet, uint64_t mask, const TriangleBatch & batch, int lane, const float * maxT, float * outT)
+{
+    auto vertex0 = batch.GetVertex0(lane), edge1 = batch.GetEdge1(lane), edge2 = batch.GetEdge2(lane);
+    uint64_t hits = 0;
+    for(int group=0, groups=packet.GetGroupCount(); group<groups; ++group)
+    {
+        int groupMask = RayPacket::GetGroupMask(mask, group);
+        if(!groupMask) continue;
+        vfloat t;
+        RAYTRACE_COUNT(TriangleTests, SIMD_WIDTH);
+        auto hit = IntersectRaysTriangle(packet.GetOrigins(group), packet.GetDirections(group), vertex0, edge1, edge2, vfloat::Load(maxT + group*SIMD_WIDTH), &t) & vmask::FromBits(groupMask);
+        hits |= (uint64_t)hit.GetBits() << (group*SIMD_WIDTH);
+        t.Store(outT + group*SIMD_WIDTH);
+    }
+    return hits;
+}
+
+uint64_t Mesh::CheckOcclusionPacket(const RayPacket & packet, uint64_t mask) const
+{
+    if(bvh.nodes.empty())
+    {
+        uint64_t occluded = 0;
+        for(int i=0; i<packet.size; ++i) if((mask >> i & 1) && CheckOcclusion(packet.GetRay(i))) occluded |= 1ull << i;
+        return occluded;
+    }
+
+    float maxT[RayPacket::MaxSize];
+    std::fill(maxT, maxT + packet.size, std::numeric_limits<float>::infinity());
+    return bvh.TraversePacket(packet, mask, maxT, [&](const BvhNode & leaf, uint64_t leafMask)
+    {
+        uint64_t occluded = 0;
+        float t[RayPacket::MaxSize];
+        for(int i=leaf.first; i<leaf.first+leaf.count && occluded != leafMask; ++i)
+        {
+            for(int lane=0; lane<SIMD_WIDTH; ++lane)
+            {
+                if(batchTriangles[i*SIMD_WIDTH + lane] >= 0) occluded |= IntersectRaysTriangle(packet, leafMask & ~occluded, batches[i], lane, maxT, t);
+            }
+        }
+        return occluded;
+    });
+}
+
+void Mesh::IntersectPacket(const RayPacket & packet, uint64_t mask, float * maxT, Hit * hits) const
+{
+    if(bvh.nodes.empty())
+    {
+        for(int i=0; i<packet.size; ++i)
+        {
+            if(!(mask >> i & 1)) continue;
+            auto hit = Intersect(packet.GetRay(i), maxT[i]);
+            if(hit.distance < maxT[i]) maxT[i] = (hits[i] = hit).distance;
+        }
+        return;
+    }
+
+    uint64_t found = 0;
+    int bestTri[RayPacket::MaxSize];
+    bvh.TraversePacket(packet, mask, maxT, [&](const BvhNode & leaf, uint64_t leafMask)
+    {
+        float t[RayPacket::MaxSize];
+        for(int i=leaf.first; i<leaf.first+leaf.count; ++i)
+        {
+            for(int lane=0; lane<SIMD_WIDTH; ++lane)
+            {
+                int tri = batchTriangles[i*SIMD_WIDTH + lane];
+                if(tri < 0) continue;
+                auto hitMask = IntersectRaysTriangle(packet, leafMask, batches[i], lane, maxT, t);
+                found |= hitMask;
+                for(int j=0; hitMask; ++j, hitMask >>= 1)
+                {
+                    if(!(hitMask & 1)) continue;
+                    bestTri[j] = tri;
+                    maxT[j] = t[j];
+                }
+            }
+        }
+        return 0ull;
+    });
+
+    for(int i=0; found; ++i, found >>= 1)
+    {
+        if(!(found & 1)) continue;
+        hits[i] = Hit(maxT[i], precomputedTriangles[bestTri[i]].normal, &material);
+    }
+}
+
+uint64_t Sphere::CheckOcclusionPacket(const RayPacket & packet, uint64_t mask) const
+{
+    uint64_t occluded = 0;
+    for(int group=0, groups=packet.GetGroupCount(); group<groups; ++group)
+    {
+        int groupMask = RayPacket::GetGroupMask(mask, group);
+        if(!groupMask) continue;
+        vfloat t;
+        RAYTRACE_COUNT(SphereTests, SIMD_WIDTH);
+        auto hit = IntersectRaysSphere(packet.GetOrigins(group), packet.GetDirections(group), position, radius, std::numeric_limits<float>::infinity(), &t) & vmask::FromBits(groupMask);
+        occluded |= (uint64_t)hit.GetBits() << (group*SIMD_WIDTH);
+    }
+    return occluded;
+}
+
+void Sphere::IntersectPacket(const RayPacket & packet, uint64_t mask, float * maxT, Hit * hits) const
+{
+    for(int group=0, groups=packet.GetGroupCount(); group<groups; ++group)
+    {
+        int groupMask = RayPacket::GetGroupMask(mask, group);
+        if(!groupMask) continue;
+        vfloat t;
+        RAYTRACE_COUNT(SphereTests, SIMD_WIDTH);
+        int hitMask = (IntersectRaysSphere(packet.GetOrigins(group), packet.GetDirections(group), position, radius, vfloat::Load(maxT + group*SIMD_WIDTH), &t) & vmask::FromBits(groupMask)).GetBits();
+        for(int lane=0; hitMask; ++lane, hitMask >>= 1)
+        {
+            if(!(hitMask & 1)) continue;
+
+            // Only the few rays which hit need a normal, which is computed exactly as Intersect would
+            int i = group*SIMD_WIDTH + lane;
+            auto hit = Intersect(packet.GetRay(i));
+            if(hit.distance < maxT[i]) maxT[i] = (hits[i] = hit).distance;
+        }
+    }
+}
+
+// Transforms the rays of a packet into the space of an instanced mesh
+static RayPacket DetransformPacket(const RayPacket & packet, const Pose & pose)
+{
+    auto inverse = pose.GetInverse();
+    RayPacket local;
+    for(int i=0; i<packet.size; ++i) local.AddRay(inverse * packet.GetRay(i));
+    return local;
+}
+
+uint64_t MeshInstance::CheckOcclusionPacket(const RayPacket & packet, uint64_t mask) const
+{
+    return mask ? mesh->CheckOcclusionPacket(DetransformPacket(packet, pose), mask) : 0;
+}
+
+void MeshInstance::IntersectPacket(const RayPacket & packet, uint64_t mask, float * maxT, Hit * hits) const
+{
+    if(!mask) return;
+    float oldMaxT[RayPacket::MaxSize];
+    std::copy(maxT, maxT + packet.size, oldMaxT);
+    mesh->IntersectPacket(DetransformPacket(packet, pose), mask, maxT, hits);
+    for(int i=0; i<packet.size; ++i)
+    {
+        if(maxT[i] < oldMaxT[i]) hits[i] = Hit(hits[i].distance, pose.TransformDirection(hits[i].normal), &material);
+    }
+}
+
+// Returns the rays in mask which do not ignore the given material
+static uint64_t GetUnignoredMask(const RayPacket & packet, uint64_t mask, const Material * const * ignore, const Material & material)
+{
+    if(ignore) for(int i=0; i<packet.size; ++i) if(ignore[i] == &material) mask &= ~(1ull << i);
+    return mask;
+}
+
+// Tests every object except paged meshes, which the stream functions defer
+static uint64_t CheckObjectOcclusionPacket(const Scene & scene, const RayPacket & packet, const Material * const * ignore)
+{
+    auto mask = packet.GetMask();
+    if(scene.bvh.nodes.empty())
+    {
+        uint64_t occluded = 0;
+        for(auto & sphere : scene.spheres) occluded |= sphere.CheckOcclusionPacket(packet, GetUnignoredMask(packet, mask & ~occluded, ignore, sphere.material));
+        for(auto & mesh : scene.meshes) occluded |= mesh.CheckOcclusionPacket(packet, GetUnignoredMask(packet, mask & ~occluded, ignore, mesh.material));
+        for(auto & instance : scene.instances) occluded |= instance.CheckOcclusionPacket(packet, GetUnignoredMask(packet, mask & ~occluded, ignore, instance.material));
+        return occluded;
+    }
+
+    float maxT[RayPacket::MaxSize];
+    std::fill(maxT, maxT + packet.size, std::numeric_limits<float>::infinity());
+    return scene.bvh.TraversePacket(packet, mask, maxT, [&](const BvhNode & leaf, uint64_t leafMask)
+    {
+        uint64_t occluded = 0;
+        for(int i=leaf.first; i<leaf.first+leaf.count && occluded != leafMask; ++i)
+        {
+            size_t index = scene.bvh.indices[i];
+            if(index < scene.spheres.size())
+            {
+                auto & sphere = scene.spheres[index];
+                occluded |= sphere.CheckOcclusionPacket(packet, GetUnignoredMask(packet, leafMask & ~occluded, ignore, sphere.material));
+            }
+            else if(index < scene.spheres.size() + scene.meshes.size())
+            {
+                auto & mesh = scene.meshes[index - scene.spheres.size()];
+                occluded |= mesh.CheckOcclusionPacket(packet, GetUnignoredMask(packet, leafMask & ~occluded, ignore, mesh.material));
+            }
+            else
+            {
+                auto & instance = scene.instances[index - scene.spheres.size() - scene.meshes.size()];
+                occluded |= instance.CheckOcclusionPacket(packet, GetUnignoredMask(packet, leafMask & ~occluded, ignore, instance.material));
+            }
+        }
+        return occluded;
+    });
+}
+
+static void IntersectObjectPacket(const Scene & scene, const RayPacket & packet, const Material * const * ignore, Hit * hits)
+{
+    auto mask = packet.GetMask();
+    float maxT[RayPacket::MaxSize];
+    for(int i=0; i<packet.size; ++i) maxT[i] = (hits[i] = Hit()).distance;
+
+    if(scene.bvh.nodes.empty())
+    {
+        for(auto & sphere : scene.spheres) sphere.IntersectPacket(packet, GetUnignoredMask(packet, mask, ignore, sphere.material), maxT, hits);
+        for(auto & mesh : scene.meshes) mesh.IntersectPacket(packet, GetUnignoredMask(packet, mask, ignore, mesh.material), maxT, hits);
+        for(auto & instance : scene.instances) instance.IntersectPacket(packet, GetUnignoredMask(packet, mask, ignore, instance.material), maxT, hits);
+    }
+    else scene.bvh.TraversePacket(packet, mask, maxT, [&](const BvhNode & leaf, uint64_t leafMask)
+    {
+        for(int i=leaf.first; i<leaf.first+leaf.count; ++i)
+        {
+            size_t index = scene.bvh.indices[i];
+            if(index < scene.spheres.size())
+            {
+                auto & sphere = scene.spheres[index];
+                sphere.IntersectPacket(packet, GetUnignoredMask(packet, leafMask, ignore, sphere.material), maxT, hits);
+            }
+            else if(index < scene.spheres.size() + scene.meshes.size())
+            {
+                auto & mesh = scene.meshes[index - scene.spheres.size()];
+                mesh.IntersectPacket(packet, GetUnignoredMask(packet, leafMask, ignore, mesh.material), maxT, hits);
+            }
+            else
+            {
+                auto & instance = scene.instances[index - scene.spheres.size() - scene.meshes.size()];
+                instance.IntersectPacket(packet, GetUnignoredMask(packet, leafMask, ignore, instance.material), maxT, hits);
+            }
+        }
+        return 0ull;
+    });
+
+    for(int i=0; i<packet.size; ++i)
+    {
+        auto ray = packet.GetRay(i);
+        hits[i].point = ray.origin + ray.direction * hits[i].distance;
+    }
+}
+
+uint64_t Scene::CheckOcclusionPacket(const RayPacket & packet, const Material * const * ignore) const
+{
+    // Paged meshes are tested one ray at a time, waiting on any blocks they reach
+    RAYTRACE_COUNT(ShadowRays, packet.size);
+    auto occluded = CheckObjectOcclusionPacket(*this, packet, ignore);
+    for(auto & mesh : pagedMeshes)
+    {
+        for(int i=0; i<packet.size; ++i)
+        {
+            if(occluded >> i & 1 || (ignore && ignore[i] == &mesh->material)) continue;
+            if(mesh->CheckOcclusion(packet.GetRay(i))) occluded |= 1ull << i;
+        }
+    }
+    RAYTRACE_COUNT(ShadowEarlyOuts, CountBits(occluded));
+    return occluded;
+}
+
+void Scene::IntersectPacket(const RayPacket & packet, const Material * const * ignore, Hit * hits) const
+{
+    RAYTRACE_COUNT(Rays, packet.size);
+    IntersectObjectPacket(*this, packet, ignore, hits);
+    for(auto & mesh : pagedMeshes)
+    {
+        for(int i=0; i<packet.size; ++i)
+        {
+            if(ignore && ignore[i] == &mesh->material) continue;
+            auto ray = packet.GetRay(i);
+            auto hit = mesh->Intersect(ray, hits[i].distance);
+            if(!hit.IsHit()) continue;
+            hits[i] = hit;
+            hits[i].point = ray.origin + ray.direction * hit.distance;
+        }
+    }
+}
+
+// Orders the rays by the octant of their direction, keeping their original order within each octant, so that packets hold similar rays
+static void SortByOctant(const Ray * rays, size_t count, std::vector<int> & order)
+{
+    auto getOctant = [rays](size_t i) { auto & d = rays[i].direction; return (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0); };
+    size_t offsets[9] = {};
+    for(size_t i=0; i<count; ++i) ++offsets[getOctant(i)+1];
+    for(int i=1; i<9; ++i) offsets[i] += offsets[i-1];
+    order.resize(count);
+    for(size_t i=0; i<count; ++i) order[offsets[getOctant(i)]++] = (int)i;
+}
+
+#ifdef RAYTRACE_STATS
+static int64_t CountOccluded(const uint64_t * occluded, size_t count)
+{
+    int64_t total = 0;
+    for(size_t i=0; i<(count + 63) / 64; ++i) total += CountBits(occluded[i]);
+    return total;
+}
+#endif
+
+void Scene::CheckOcclusionStream(const Ray * rays, const Material * const * ignore, size_t count, uint64_t * occluded) const
+{
+    std::vector<int> order;
+    SortByOctant(rays, count, order);
+    std::fill(occluded, occluded + (count + 63) / 64, 0);
+
+    RayPacket packet;
+    const Material * packetIgnore[RayPacket::MaxSize];
+    for(size_t first=0; first<count; first+=RayPacket::MaxSize)
+    {
+        packet.Clear();
+        for(size_t i=first; i<count && packet.size<RayPacket::MaxSize; ++i)
+        {
+            packetIgnore[packet.size] = ignore ? ignore[order[i]] : nullptr;
+            packet.AddRay(rays[order[i]]);
+        }
+        auto packetOccluded = CheckObjectOcclusionPacket(*this, packet, ignore ? packetIgnore : nullptr);
+        for(int i=0; packetOccluded; ++i, packetOccluded >>= 1)
+        {
+            int index = order[first+i];
+            if(packetOccluded & 1) occluded[index/64] |= 1ull << (index%64);
+        }
+    }
+    for(auto & mesh : pagedMeshes) mesh->CheckOcclusionStream(rays, ignore, count, occluded);
+    RAYTRACE_COUNT(ShadowRays, count);
+    RAYTRACE_COUNT(ShadowEarlyOuts, CountOccluded(occluded, count));
+}
+
+void Scene::IntersectStream(const Ray * rays, const Material * const * ignore, size_t count, Hit * hits) const
+{
+    std::vector<int> order;
+    SortByOctant(rays, count, order);
+
+    RayPacket packet;
+    const Material * packetIgnore[RayPacket::MaxSize];
+    Hit packetHits[RayPacket::MaxSize];
+    for(size_t first=0; first<count; first+=RayPacket::MaxSize)
+    {
+        packet.Clear();
+        for(size_t i=first; i<count && packet.size<RayPacket::MaxSize; ++i)
+        {
+            packetIgnore[packet.size] = ignore ? ignore[order[i]] : nullptr;
+            packet.AddRay(rays[order[i]]);
+        }
+        IntersectObjectPacket(*this, packet, ignore ? packetIgnore : nullptr, packetHits);
+        for(int i=0; i<packet.size; ++i) hits[order[first+i]] = packetHits[i];
+    }
+    for(auto & mesh : pagedMeshes) mesh->IntersectStream(rays, ignore, count, hits);
+    RAYTRACE_COUNT(Rays, count);
+}
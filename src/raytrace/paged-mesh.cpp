@@ -0,0 +1,395 @@
+#include "paged-mesh.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    // Block data starts on cache line boundaries, so that batches are aligned for SIMD loads in the file as well as once copied out of it
+    const uint64_t blockAlignment = 64;
+
+    // Must be incremented whenever the file layout changes, including the layout of any structure stored in it
+    const uint32_t pagedMeshVersion = 1;
+
+    struct PagedMeshHeader
+    {
+        char magic[4];
+        uint32_t version, simdWidth;
+        uint32_t nodeSize, batchSize; // Structure sizes, which catch changes in layout between compilers and platforms
+        uint32_t skeletonNodeCount, blockCount;
+    };
+
+    struct BlockRecord
+    {
+        uint64_t offset; // Of the block's nodes, followed by its batches, then one normal per lane of each batch
+        uint32_t nodeCount, batchCount;
+    };
+
+    PagedMeshHeader GetExpectedHeader()
+    {
+        PagedMeshHeader header = {{'R','T','P','M'}, pagedMeshVersion, SIMD_WIDTH, sizeof(BvhNode), sizeof(TriangleBatch)};
+        return header;
+    }
+
+    uint64_t GetBlockDataSize(uint64_t nodeCount, uint64_t batchCount)
+    {
+        return nodeCount * sizeof(BvhNode) + batchCount * sizeof(TriangleBatch) + batchCount * SIMD_WIDTH * sizeof(float3);
+    }
+
+    uint64_t AlignBlockOffset(uint64_t offset) { return (offset + blockAlignment - 1) / blockAlignment * blockAlignment; }
+
+    template<class T> void WriteArray(std::ofstream & out, const std::vector<T> & values) { out.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T)); }
+}
+
+void WritePagedMesh(const Mesh & mesh, const char * filename, int blockTriangles)
+{
+    if(mesh.bvh.nodes.empty()) throw std::runtime_error(std::string("Unable to write ") + filename + ", as the mesh has no hierarchy.");
+    auto & nodes = mesh.bvh.nodes;
+
+    // Children follow their parents, so a reverse pass counts the batches and nodes of both children before their parent
+    std::vector<int> batchCounts(nodes.size()), nodeCounts(nodes.size());
+    for(size_t i=nodes.size(); i--; )
+    {
+        auto & node = nodes[i];
+        batchCounts[i] = node.IsLeaf() ? node.count : batchCounts[node.first] + batchCounts[node.first+1];
+        nodeCounts[i] = node.IsLeaf() ? 1 : 1 + nodeCounts[node.first] + nodeCounts[node.first+1];
+    }
+
+    // The skeleton copies the top of the hierarchy, down to the first nodes small enough to become blocks
+    int maxBlockBatches = std::max(blockTriangles / SIMD_WIDTH, 1);
+    std::vector<BvhNode> skeleton(1);
+    std::vector<int> blockRoots;
+    std::vector<std::pair<int, int>> stack(1, std::make_pair(0, 0)); // Node of the mesh, and where it is copied
+    while(!stack.empty())
+    {
+        auto next = stack.back();
+        stack.pop_back();
+        auto & node = nodes[next.first];
+        if(node.IsLeaf() || batchCounts[next.first] <= maxBlockBatches)
+        {
+            skeleton[next.second] = {node.bounds, (int)blockRoots.size(), 1};
+            blockRoots.push_back(next.first);
+            continue;
+        }
+        int child = (int)skeleton.size();
+        skeleton.resize(child + 2);
+        skeleton[next.second] = {node.bounds, child, 0};
+        stack.push_back(std::make_pair(node.first, child));
+        stack.push_back(std::make_pair(node.first+1, child+1));
+    }
+
+    auto header = GetExpectedHeader();
+    header.skeletonNodeCount = (uint32_t)skeleton.size();
+    header.blockCount = (uint32_t)blockRoots.size();
+    std::vector<BlockRecord> records;
+    uint64_t offset = sizeof(header) + skeleton.size() * sizeof(BvhNode) + blockRoots.size() * sizeof(BlockRecord);
+    for(int root : blockRoots)
+    {
+        BlockRecord record = {AlignBlockOffset(offset), (uint32_t)nodeCounts[root], (uint32_t)batchCounts[root]};
+        records.push_back(record);
+        offset = record.offset + GetBlockDataSize(record.nodeCount, record.batchCount);
+    }
+
+    std::ofstream out(filename, std::ofstream::binary);
+    if(!out) throw std::runtime_error(std::string("Unable to write ") + filename + ".");
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    WriteArray(out, skeleton);
+    WriteArray(out, records);
+
+    // Each block copies a subtree, with its leaves renumbered to refer to the batches copied into the block
+    std::vector<BvhNode> blockNodes;
+    std::vector<TriangleBatch> blockBatches;
+    std::vector<float3> blockNormals;
+    uint64_t position = sizeof(header) + skeleton.size() * sizeof(BvhNode) + records.size() * sizeof(BlockRecord);
+    for(size_t i=0; i<blockRoots.size(); ++i)
+    {
+        blockNodes.assign(1, BvhNode());
+        blockBatches.clear();
+        blockNormals.clear();
+        stack.assign(1, std::make_pair(blockRoots[i], 0));
+        while(!stack.empty())
+        {
+            auto next = stack.back();
+            stack.pop_back();
+            auto & node = nodes[next.first];
+            if(node.IsLeaf())
+            {
+                blockNodes[next.second] = {node.bounds, (int)blockBatches.size(), node.count};
+                for(int batch=node.first; batch<node.first+node.count; ++batch)
+                {
+                    blockBatches.push_back(mesh.batches[batch]);
+                    for(int lane=0; lane<SIMD_WIDTH; ++lane)
+                    {
+                        int triangle = mesh.batchTriangles[batch*SIMD_WIDTH + lane];
+                        blockNormals.push_back(triangle >= 0 ? mesh.precomputedTriangles[triangle].normal : float3(0,0,0));
+                    }
+                }
+                continue;
+            }
+            int child = (int)blockNodes.size();
+            blockNodes.resize(child + 2);
+            blockNodes[next.second] = {node.bounds, child, 0};
+            stack.push_back(std::make_pair(node.first, child));
+            stack.push_back(std::make_pair(node.first+1, child+1));
+        }
+
+        static const char padding[blockAlignment] = {};
+        out.write(padding, records[i].offset - position);
+        WriteArray(out, blockNodes);
+        WriteArray(out, blockBatches);
+        WriteArray(out, blockNormals);
+        position = records[i].offset + GetBlockDataSize(blockNodes.size(), blockBatches.size());
+    }
+    if(!out) throw std::runtime_error(std::string("Unable to write ") + filename + ".");
+}
+
+PagedMesh::PagedMesh(const char * filename, size_t residencyBudget) : file(filename), budget(residencyBudget), residentBytes(0), loadCount(0), material(), pose()
+{
+    auto data = file.GetData();
+    auto size = file.GetSize();
+    auto fail = [filename]() { return std::runtime_error(std::string(filename) + " is not a paged mesh written by this build."); };
+
+    PagedMeshHeader header, expected = GetExpectedHeader();
+    if(size < sizeof(header)) throw fail();
+    memcpy(&header, data, sizeof(header));
+    if(memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version || header.simdWidth != expected.simdWidth
+        || header.nodeSize != expected.nodeSize || header.batchSize != expected.batchSize) throw fail();
+
+    uint64_t tablesSize = (uint64_t)header.skeletonNodeCount * sizeof(BvhNode) + (uint64_t)header.blockCount * sizeof(BlockRecord);
+    if(tablesSize > size - sizeof(header)) throw fail();
+    auto skeletonNodes = reinterpret_cast<const BvhNode *>(data + sizeof(header));
+    skeleton.nodes.assign(skeletonNodes, skeletonNodes + header.skeletonNodeCount);
+
+    std::vector<BlockRecord> records(header.blockCount);
+    memcpy(records.data(), data + sizeof(header) + header.skeletonNodeCount * sizeof(BvhNode), records.size() * sizeof(BlockRecord));
+    for(auto & record : records)
+    {
+        if(record.offset > size || GetBlockDataSize(record.nodeCount, record.batchCount) > size - record.offset) throw fail();
+        BlockEntry entry = {record.offset, record.nodeCount, record.batchCount};
+        blocks.push_back(entry);
+    }
+}
+
+Bounds PagedMesh::GetBounds() const
+{
+    Bounds bounds, meshBounds = skeleton.nodes.empty() ? Bounds() : skeleton.nodes[0].bounds;
+    if(meshBounds.IsEmpty()) return bounds;
+    for(int i=0; i<8; ++i) bounds.Include(pose.TransformPoint({i&1 ? meshBounds.max.x : meshBounds.min.x, i&2 ? meshBounds.max.y : meshBounds.min.y, i&4 ? meshBounds.max.z : meshBounds.min.z}));
+    return bounds;
+}
+
+size_t PagedMesh::GetResidentBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return residentBytes;
+}
+
+int64_t PagedMesh::GetLoadCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return loadCount;
+}
+
+size_t PagedMesh::GetBlockBytes(const BlockEntry & entry) const
+{
+    return (size_t)GetBlockDataSize(entry.nodeCount, entry.batchCount);
+}
+
+std::shared_ptr<const PagedMesh::Block> PagedMesh::GetBlock(int index, bool load) const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto & entry = blocks[index];
+    if(entry.resident)
+    {
+        lru.splice(lru.begin(), lru, entry.lruPosition);
+        return entry.resident;
+    }
+    if(!load) return nullptr;
+
+    // Copying happens outside the lock, so that other threads can go on tracing resident blocks. Two threads may both load the same block, in which
+    // case the first to finish keeps its copy.
+    lock.unlock();
+    auto block = std::make_shared<Block>();
+    auto nodes = reinterpret_cast<const BvhNode *>(file.GetData() + entry.offset);
+    auto batches = reinterpret_cast<const TriangleBatch *>(nodes + entry.nodeCount);
+    auto normals = reinterpret_cast<const float3 *>(batches + entry.batchCount);
+    block->bvh.nodes.assign(nodes, nodes + entry.nodeCount);
+    block->batches.assign(batches, batches + entry.batchCount);
+    block->normals.assign(normals, normals + entry.batchCount * SIMD_WIDTH);
+    lock.lock();
+
+    if(entry.resident)
+    {
+        lru.splice(lru.begin(), lru, entry.lruPosition);
+        return entry.resident;
+    }
+    entry.resident = block;
+    lru.push_front(index);
+    entry.lruPosition = lru.begin();
+    residentBytes += GetBlockBytes(entry);
+    ++loadCount;
+
+    // The block just loaded is never evicted, even if it alone exceeds the budget
+    while(residentBytes > budget && lru.size() > 1)
+    {
+        auto & evicted = blocks[lru.back()];
+        lru.pop_back();
+        residentBytes -= GetBlockBytes(evicted);
+        evicted.resident.reset();
+    }
+    return block;
+}
+
+const PagedMesh::Block * PagedMesh::LookUpBlock(BlockLookups & lookups, int index) const
+{
+    auto it = lookups.find(index);
+    if(it == lookups.end()) it = lookups.insert(std::make_pair(index, GetBlock(index, false))).first;
+    return it->second.get();
+}
+
+bool PagedMesh::IntersectBlock(const Block & block, const Ray & ray, float & bestT, float3 & normal)
+{
+    bool found = false;
+    block.bvh.Traverse(ray, bestT, [&](const BvhNode & leaf, float & leafMaxT)
+    {
+        RAYTRACE_COUNT(TriangleTests, leaf.count * SIMD_WIDTH);
+        for(int i=leaf.first; i<leaf.first+leaf.count; ++i)
+        {
+            float t;
+            int lane = IntersectRayTriangles(ray, block.batches[i], bestT, &t);
+            if(lane >= 0)
+            {
+                normal = block.normals[i*SIMD_WIDTH + lane];
+                bestT = leafMaxT = t;
+                found = true;
+            }
+        }
+        return false;
+    });
+    return found;
+}
+
+bool PagedMesh::CheckBlockOcclusion(const Block & block, const Ray & ray)
+{
+    return block.bvh.Traverse(ray, std::numeric_limits<float>::infinity(), [&](const BvhNode & leaf, float &)
+    {
+        for(int i=leaf.first; i<leaf.first+leaf.count; ++i)
+        {
+            RAYTRACE_COUNT(TriangleTests, SIMD_WIDTH);
+            if(IntersectRayTriangles(ray, block.batches[i], std::numeric_limits<float>::infinity()) >= 0) return true;
+        }
+        return false;
+    });
+}
+
+bool PagedMesh::CheckOcclusion(const Ray & ray) const
+{
+    auto localRay = pose.GetInverse() * ray;
+    return skeleton.Traverse(localRay, std::numeric_limits<float>::infinity(), [&](const BvhNode & leaf, float &)
+    {
+        for(int i=leaf.first; i<leaf.first+leaf.count; ++i) if(CheckBlockOcclusion(*GetBlock(i, true), localRay)) return true;
+        return false;
+    });
+}
+
+Hit PagedMesh::Intersect(const Ray & ray, float maxT) const
+{
+    auto localRay = pose.GetInverse() * ray;
+    float bestT = maxT;
+    float3 normal;
+    bool found = false;
+    skeleton.Traverse(localRay, bestT, [&](const BvhNode & leaf, float & leafMaxT)
+    {
+        for(int i=leaf.first; i<leaf.first+leaf.count; ++i)
+        {
+            if(!IntersectBlock(*GetBlock(i, true), localRay, bestT, normal)) continue;
+            leafMaxT = bestT;
+            found = true;
+        }
+        return false;
+    });
+    return found ? Hit(bestT, pose.TransformDirection(normal), &material) : Hit();
+}
+
+void PagedMesh::CheckOcclusionStream(const Ray * rays, const Material * const * ignore, size_t count, uint64_t * occluded) const
+{
+    auto inverse = pose.GetInverse();
+    BlockLookups lookups;
+    std::vector<std::pair<int, int>> deferred; // Missing block, and the ray waiting on it
+    for(size_t i=0; i<count; ++i)
+    {
+        if(occluded[i/64] >> (i%64) & 1 || (ignore && ignore[i] == &material)) continue;
+        auto localRay = inverse * rays[i];
+        if(skeleton.Traverse(localRay, std::numeric_limits<float>::infinity(), [&](const BvhNode & leaf, float &)
+        {
+            for(int j=leaf.first; j<leaf.first+leaf.count; ++j)
+            {
+                auto block = LookUpBlock(lookups, j);
+                if(!block) deferred.push_back(std::make_pair(j, (int)i));
+                else if(CheckBlockOcclusion(*block, localRay)) return true;
+            }
+            return false;
+        })) occluded[i/64] |= 1ull << (i%64);
+    }
+
+    // Rays occluded by a resident block no longer need to wait on any missing ones
+    std::sort(begin(deferred), end(deferred));
+    for(size_t first=0, last; first<deferred.size(); first=last)
+    {
+        std::shared_ptr<const Block> block;
+        for(last=first; last<deferred.size() && deferred[last].first == deferred[first].first; ++last)
+        {
+            int i = deferred[last].second;
+            if(occluded[i/64] >> (i%64) & 1) continue;
+            if(!block) block = GetBlock(deferred[first].first, true);
+            if(CheckBlockOcclusion(*block, inverse * rays[i])) occluded[i/64] |= 1ull << (i%64);
+        }
+    }
+}
+
+void PagedMesh::IntersectStream(const Ray * rays, const Material * const * ignore, size_t count, Hit * hits) const
+{
+    auto inverse = pose.GetInverse();
+    auto intersect = [&](const Block & block, int i, const Ray & localRay)
+    {
+        float bestT = hits[i].distance;
+        float3 normal;
+        if(!IntersectBlock(block, localRay, bestT, normal)) return false;
+        hits[i] = Hit(bestT, pose.TransformDirection(normal), &material);
+        hits[i].point = rays[i].origin + rays[i].direction * bestT;
+        return true;
+    };
+
+    // Deferred rays miss the chance to cull blocks behind the hits they would have found, but are still only tested against blocks nearer than
+    // the nearest hit found so far, so each ray ends up with the nearest hit of all
+    BlockLookups lookups;
+    std::vector<std::pair<int, int>> deferred; // Missing block, and the ray waiting on it
+    for(size_t i=0; i<count; ++i)
+    {
+        if(ignore && ignore[i] == &material) continue;
+        auto localRay = inverse * rays[i];
+        skeleton.Traverse(localRay, hits[i].distance, [&](const BvhNode & leaf, float & maxT)
+        {
+            for(int j=leaf.first; j<leaf.first+leaf.count; ++j)
+            {
+                auto block = LookUpBlock(lookups, j);
+                if(!block) deferred.push_back(std::make_pair(j, (int)i));
+                else if(intersect(*block, (int)i, localRay)) maxT = hits[i].distance;
+            }
+            return false;
+        });
+    }
+
+    std::sort(begin(deferred), end(deferred));
+    for(size_t first=0, last; first<deferred.size(); first=last)
+    {
+        auto block = GetBlock(deferred[first].first, true);
+        for(last=first; last<deferred.size() && deferred[last].first == deferred[first].first; ++last)
+        {
+            int i = deferred[last].second;
+            intersect(*block, i, inverse * rays[i]);
+        }
+    }
+}
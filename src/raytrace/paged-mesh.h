@@ -0,0 +1,75 @@
+#pragma once
+
+#include "raytrace.h"
+#include "mapped-file.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+// A mesh too large to keep in memory, traced from a file written by WritePagedMesh. Only the top of its hierarchy stays resident. Below that, the
+// hierarchy is cut into blocks, each holding one subtree and its triangles, which are copied out of the memory-mapped file when rays first reach
+// them, and evicted least recently used first once the resident blocks exceed a budget. Rays traced one at a time wait for the blocks they reach
+// to load. The stream functions instead defer rays which reach a missing block until the whole stream has been traversed, then load each missing
+// block once, for every ray waiting on it.
+class PagedMesh
+{
+    struct Block
+    {
+        Bvh bvh;                            // Leaves refer to the range of batches [first, first+count)
+        std::vector<TriangleBatch> batches;
+        std::vector<float3> normals;        // One per lane of each batch
+    };
+
+    struct BlockEntry
+    {
+        uint64_t offset;
+        uint32_t nodeCount, batchCount;
+        std::shared_ptr<const Block> resident; // Null unless loaded, and still shared by any rays tracing it after eviction
+        std::list<int>::iterator lruPosition;  // Valid while resident
+    };
+
+    // Blocks looked up by one call to a stream function, including missing ones, so that each is looked up only once per call, and resident
+    // ones cannot be freed while the call is still using them
+    typedef std::unordered_map<int, std::shared_ptr<const Block>> BlockLookups;
+
+    MappedFile file;
+    Bvh skeleton; // Leaves refer to the range of blocks [first, first+count)
+    size_t budget;
+
+    // Residency is shared by every thread tracing the mesh, and changes as it is traced, so is guarded by the mutex even though tracing is const
+    mutable std::mutex mutex;
+    mutable std::vector<BlockEntry> blocks;
+    mutable std::list<int> lru; // Resident blocks, most recently used first
+    mutable size_t residentBytes;
+    mutable int64_t loadCount;
+
+    PagedMesh(const PagedMesh &); // Noncopyable
+
+    size_t GetBlockBytes(const BlockEntry & entry) const;
+    std::shared_ptr<const Block> GetBlock(int index, bool load) const; // Returns null if the block is not resident, unless load is set
+    const Block * LookUpBlock(BlockLookups & lookups, int index) const;
+
+    static bool IntersectBlock(const Block & block, const Ray & ray, float & bestT, float3 & normal);
+    static bool CheckBlockOcclusion(const Block & block, const Ray & ray);
+public:
+    Material material;
+    Pose pose; // Rays are transformed into the space of the file's vertices, as for a MeshInstance
+
+    PagedMesh(const char * filename, size_t residencyBudget); // Throws std::runtime_error if the file cannot be read or is not a paged mesh
+
+    Bounds GetBounds() const;
+    size_t GetBlockCount() const { return blocks.size(); }
+    size_t GetResidentBytes() const;
+    int64_t GetLoadCount() const; // Blocks loaded so far, counting every reload of an evicted block
+
+    bool CheckOcclusion(const Ray & ray) const;
+    Hit Intersect(const Ray & ray, float maxT = std::numeric_limits<float>::infinity()) const;
+
+    // Sets bit i%64 of occluded[i/64] if ray i is occluded by the mesh, leaving it set if it already was. ignore may be null, or hold one material
+    // per ray. IntersectStream replaces the entries of hits, including their points, for rays which hit the mesh nearer than their entry.
+    void CheckOcclusionStream(const Ray * rays, const Material * const * ignore, size_t count, uint64_t * occluded) const;
+    void IntersectStream(const Ray * rays, const Material * const * ignore, size_t count, Hit * hits) const;
+};
+
+// Writes a mesh whose hierarchy has been built in the format read by PagedMesh, cutting its hierarchy into blocks of at most blockTriangles triangles
+void WritePagedMesh(const Mesh & mesh, const char * filename, int blockTriangles = 16384);
@@ -0,0 +1,102 @@
+#include "preview.h"
+
+#include <cstdio>
+
+// Tokens from OpenGL 2.1, which the Windows OpenGL headers do not define
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_WRITE_ONLY
+#define GL_WRITE_ONLY 0x88B9
+#endif
+#ifndef GL_SRGB8
+#define GL_SRGB8 0x8C41
+#endif
+
+PreviewTexture::PreviewTexture() : nextBuffer(0)
+{
+    genBuffers = (GenBuffersProc)glfwGetProcAddress("glGenBuffers");
+    deleteBuffers = (DeleteBuffersProc)glfwGetProcAddress("glDeleteBuffers");
+    bindBuffer = (BindBufferProc)glfwGetProcAddress("glBindBuffer");
+    bufferData = (BufferDataProc)glfwGetProcAddress("glBufferData");
+    mapBuffer = (MapBufferProc)glfwGetProcAddress("glMapBuffer");
+    unmapBuffer = (UnmapBufferProc)glfwGetProcAddress("glUnmapBuffer");
+
+    buffers[0] = buffers[1] = 0;
+    if(genBuffers && deleteBuffers && bindBuffer && bufferData && mapBuffer && unmapBuffer) genBuffers(2, buffers);
+
+    int major = 0, minor = 0;
+    auto version = (const char *)glGetString(GL_VERSION);
+    if(version) sscanf(version, "%d.%d", &major, &minor);
+    srgb = major > 2 || (major == 2 && minor >= 1) || glfwExtensionSupported("GL_EXT_texture_sRGB");
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+}
+
+PreviewTexture::~PreviewTexture()
+{
+    if(IsUsingPixelBuffers()) deleteBuffers(2, buffers);
+    glDeleteTextures(1, &texture);
+}
+
+void PreviewTexture::Reset(const int2 & dimensions)
+{
+    // Sampling an sRGB texture converts back to linear values, so the preview looks the same as if the float pixels were uploaded directly, as does
+    // a linear texture holding linear values, at the cost of precision in dark colors
+    std::vector<uint8_t> black(dimensions.x * dimensions.y * 3);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, srgb ? GL_SRGB8 : GL_RGB8, dimensions.x, dimensions.y, 0, GL_RGB, GL_UNSIGNED_BYTE, black.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void PreviewTexture::Upload(const std::vector<ConvertedTile> & tiles)
+{
+    if(tiles.empty()) return;
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    // Orphaning the buffer's previous storage lets the driver keep transferring from it while we write the new tiles
+    uint8_t * pixels = nullptr;
+    if(IsUsingPixelBuffers())
+    {
+        size_t size = 0;
+        for(auto & tile : tiles) size += tile.pixels.size();
+        bindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[nextBuffer]);
+        bufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+        pixels = (uint8_t *)mapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+        if(!pixels) bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    if(pixels)
+    {
+        size_t offset = 0;
+        for(auto & tile : tiles)
+        {
+            std::copy(begin(tile.pixels), end(tile.pixels), pixels + offset);
+            offset += tile.pixels.size();
+        }
+        unmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        nextBuffer = 1 - nextBuffer;
+
+        // While a pixel unpack buffer is bound, the data pointer passed to glTexSubImage2D is an offset into the buffer
+        offset = 0;
+        for(auto & tile : tiles)
+        {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, tile.tile.min.x, tile.tile.min.y, tile.tile.max.x - tile.tile.min.x, tile.tile.max.y - tile.tile.min.y, GL_RGB, GL_UNSIGNED_BYTE, (const uint8_t *)nullptr + offset);
+            offset += tile.pixels.size();
+        }
+        bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    else for(auto & tile : tiles)
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, tile.tile.min.x, tile.tile.min.y, tile.tile.max.x - tile.tile.min.x, tile.tile.max.y - tile.tile.min.y, GL_RGB, GL_UNSIGNED_BYTE, tile.pixels.data());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "image.h"
+#include "window.h"
+
+// Displays a RaytracedImage as it is traced. Finished tiles arrive already converted to 8-bit sRGB, a quarter of the size of float data,
+// and are streamed into the texture through two pixel buffer objects used in turn, so that filling one can overlap the transfer from
+// the other. If pixel buffer objects are unavailable, tiles are uploaded directly from client memory. If sRGB textures are unavailable, before
+// OpenGL 2.1 without EXT_texture_sRGB, tiles must instead hold linear 8-bit values.
+class PreviewTexture
+{
+    typedef void (APIENTRY * GenBuffersProc)(GLsizei, GLuint *);
+    typedef void (APIENTRY * DeleteBuffersProc)(GLsizei, const GLuint *);
+    typedef void (APIENTRY * BindBufferProc)(GLenum, GLuint);
+    typedef void (APIENTRY * BufferDataProc)(GLenum, ptrdiff_t, const void *, GLenum);
+    typedef void * (APIENTRY * MapBufferProc)(GLenum, GLenum);
+    typedef GLboolean (APIENTRY * UnmapBufferProc)(GLenum);
+
+    GenBuffersProc genBuffers;
+    DeleteBuffersProc deleteBuffers;
+    BindBufferProc bindBuffer;
+    BufferDataProc bufferData;
+    MapBufferProc mapBuffer;
+    UnmapBufferProc unmapBuffer;
+
+    GLuint texture, buffers[2];
+    int nextBuffer;
+    bool srgb;
+
+    PreviewTexture(const PreviewTexture &); // Noncopyable
+public:
+    PreviewTexture(); // Requires a current OpenGL context
+    ~PreviewTexture();
+
+    GLuint GetTexture() const { return texture; }
+    bool IsUsingPixelBuffers() const { return buffers[0] != 0; }
+    bool IsUsingSrgb() const { return srgb; } // Tiles should be encoded as sRGB, rather than hold linear values
+
+    // Resizes the texture and clears it to black
+    void Reset(const int2 & dimensions);
+
+    // Copies the given tiles into the texture
+    void Upload(const std::vector<ConvertedTile> & tiles);
+};
@@ -1,4 +1,5 @@
-#include "raytrace.h"
+#include "preview.h"
+#include "render-thread.h"
 
 #define GLFW_INCLUDE_GLU
 #include "window.h"
@@ -8,101 +9,124 @@
 #include <iostream>
 #include <chrono>
 
-struct RaytracedImage
-{
-    std::vector<float3> pixels;
-    int2 dimensions;
-    Pose viewPose;
-    int currentLine = 0;
-
-    bool IsComplete() const { return currentLine == dimensions.y; }
-
-    void Reset(const int2 & dimensions, const Pose & viewPose)
-    {
-        pixels.resize(dimensions.x * dimensions.y);
-        this->dimensions = dimensions;
-        this->viewPose = viewPose;
-        currentLine = 0;
-    }
-
-    void RaytracePixel(const Scene & scene, const int2 & coord)
-    {
-        auto halfDims = float2(dimensions - 1) * 0.5f;
-        auto aspectRatio = (float)dimensions.x / dimensions.y;
-        auto viewDirection = norm(float3((coord.x-halfDims.x)*aspectRatio/halfDims.x, (halfDims.y-coord.y)/halfDims.y, -1));
-        pixels[coord.y * dimensions.x + coord.x] = scene.CastPrimaryRay(viewPose * Ray{{0,0,0}, viewDirection});
-    }
-
-    void RaytraceLine(const Scene & scene)
-    {
-        if(currentLine < dimensions.y)
-        {
-            for(int x=0; x<dimensions.x; ++x)
-            {
-                RaytracePixel(scene, {x,currentLine});
-            }
-            ++currentLine;
-        }
-    }
-};
-
 int main(int argc, char * argv[]) try
 {
     Window window({1280,720}, "Raytracing Example");
 
     window.MakeContextCurrent();
-    GLuint texture;
-    glGenTextures(1, &texture);
-
-    Scene scene;
-    scene.skyColor = float3(0,0.5f,1.0f);
-    scene.ambientLight = float3(0.3f,0.3f,0.3f);
-    scene.dirLight.direction = norm(float3(0.2f,1,-0.1f));
-    scene.dirLight.color = {0.8f,0.8f,0.5f};
-    scene.spheres.push_back({Material{{1,1,1}}, {0,0,-5}, 2});
-    scene.spheres.push_back({Material{{1,0.5f,0.5f},0.5f}, {3,-1,-7}, 2});
-    scene.spheres.push_back({Material{{0.3f,1,0.3f}}, {-3,-2,-6}, 2});
-    scene.spheres.push_back({Material{{0.4f,0.4f,1}}, {-1.5f,+2,-6}, 2});
-
-    scene.meshes.push_back({
-        Material{{0.5f,0.3f,0.1f}},
-        {{-10,-4,0}, {10,-4,0}, {10,-4,-20}, {-10,-4,-20}},
-        {{0,1,2}, {0,2,3}}
-    });
-
-    Mesh mesh;
-    mesh.material = {{1.0f,1.0f,0}};
-    float3 offset = {4.0f,-4.0f,-4.0f};
-    for(int i=0; i<24; ++i)
-    {
-        float angle = i*6.28f/24;
-        mesh.vertices.push_back(offset + float3{cosf(angle),0.0f,sinf(angle)});
-        mesh.vertices.push_back(offset + float3{cosf(angle),5.0f,sinf(angle)});
-        mesh.triangles.push_back({i*2, i*2+1, ((i+1)*2 + 1) % 48});
-        mesh.triangles.push_back({i*2, ((i+1)*2 + 1) % 48, (i+1)*2 % 48});
-        if(i>1) mesh.triangles.push_back({1,i*2+1,(i-1)*2+1});
-    }
-    scene.meshes.push_back(mesh);
+    PreviewTexture preview;
 
-    for(auto & mesh : scene.meshes) mesh.ComputeBounds();
+    ThreadPool pool;
+    auto scene = CreateExampleScene();
+    scene.BuildBvh(&pool);
 
     Pose viewPose;
 
-    RaytracedImage image;
+    RenderThread renderer(scene, pool);
+    RenderRequest request = {{0,0}, viewPose, pool.GetThreadCount() > 1, false, false, 1, 8, PixelFormat::Float, false, false, false, 256, false, preview.IsUsingSrgb()};
+    bool animating = false;
+    float renderTime = 0;
+    int renderRays = 0;
+    auto renderCounters = GetCounterTotals(); // Counters are shown relative to these totals, taken as each render starts
+
+    // Only tells the render thread what to trace, so never waits on tracing, and can be called as often as the view changes
+    auto startRender = [&]()
+    {
+        auto dimensions = window.GetFramebufferSize()/int2(2,1);
+        if(dimensions != request.dimensions)
+        {
+            // Start from a black texture covering the whole image, into which finished tiles are uploaded. Otherwise the previous image
+            // is kept on screen until the coarse pass of the new one covers it.
+            window.MakeContextCurrent();
+            preview.Reset(dimensions);
+        }
+        request.dimensions = dimensions;
+        request.viewPose = viewPose;
+        renderer.Start(request);
+        renderTime = 0;
+        renderCounters = GetCounterTotals();
+    };
+
+    // Shades the previous image again, once the scene has been edited between calls to RenderThread::Stop and this
+    auto startRelight = [&](bool shadowsChanged)
+    {
+        request.lightingOnly = true;
+        request.shadowsChanged = shadowsChanged;
+        renderer.Start(request);
+        request.lightingOnly = request.shadowsChanged = false;
+        renderTime = 0;
+        renderCounters = GetCounterTotals();
+    };
 
     window.SetKeyHandler([&](int key, int scancode, int action, int mods)
     {
         if(key == GLFW_KEY_SPACE && action == GLFW_PRESS)
         {
-            image.Reset(window.GetFramebufferSize()/int2(2,1), viewPose);
+            startRender();
+        }
+        if(key == GLFW_KEY_P && action == GLFW_PRESS)
+        {
+            request.parallel = !request.parallel;
+            startRender();
+        }
+        if(key == GLFW_KEY_F && action == GLFW_PRESS)
+        {
+            request.wavefront = !request.wavefront;
+            startRender();
+        }
+        if(key == GLFW_KEY_C && action == GLFW_PRESS)
+        {
+            request.format = request.format == PixelFormat::Float ? PixelFormat::RGB9E5 : PixelFormat::Float;
+            startRender();
+        }
+        if(key == GLFW_KEY_R && action == GLFW_PRESS)
+        {
+            request.reprojection = !request.reprojection;
+            startRender();
+        }
+        if(key == GLFW_KEY_L && action == GLFW_PRESS)
+        {
+            renderer.Stop();
+            scene.dirLight.direction = qrot(float4(0, std::sin(0.125f), 0, std::cos(0.125f)), scene.dirLight.direction);
+            startRelight(true);
+        }
+        if(key == GLFW_KEY_M && action == GLFW_PRESS)
+        {
+            renderer.Stop();
+            auto & albedo = scene.spheres[0].material.albedo;
+            albedo = float3(albedo.y, albedo.z, albedo.x);
+            startRelight(false);
+        }
+        if(key == GLFW_KEY_K && action == GLFW_PRESS)
+        {
+            request.packetSize = request.packetSize == 8 ? 1 : request.packetSize * 2;
+            startRender();
+        }
+        if(key == GLFW_KEY_G && action == GLFW_PRESS)
+        {
+            request.antialias = !request.antialias;
+            startRender();
+        }
+        if(key == GLFW_KEY_T && action == GLFW_PRESS)
+        {
+            animating = !animating;
+        }
+        if(key == GLFW_KEY_H && action == GLFW_PRESS)
+        {
+            request.heatmap = !request.heatmap;
+            startRender();
+        }
+        if((key == GLFW_KEY_LEFT_BRACKET || key == GLFW_KEY_RIGHT_BRACKET) && action == GLFW_PRESS && request.heatmap)
+        {
+            request.costScale = key == GLFW_KEY_LEFT_BRACKET ? std::max(request.costScale / 2, 1.0f) : request.costScale * 2;
+            startRender();
         }
     });
 
     auto mousePos = window.GetCursorPos();
     float pitch=0, yaw=0;
 
-    image.Reset(window.GetFramebufferSize()/int2(2,1), viewPose);
-    image.RaytracePixel(scene, window.GetFramebufferSize()/int2(4,2));
+    startRender();
 
     auto t0 = std::chrono::monotonic_clock::now();
     while(!window.WindowShouldClose())
@@ -117,6 +141,7 @@ int main(int argc, char * argv[]) try
         auto mouseDelta = newMousePos - mousePos;
         mousePos = newMousePos;
 
+        auto oldPose = viewPose;
         if(window.GetMouseButton(0))
         {
             yaw -= float(mouseDelta.x * 0.01);
@@ -130,15 +155,22 @@ int main(int argc, char * argv[]) try
         if(window.GetKey(GLFW_KEY_D)) viewPose.position += viewPose.GetXDir() * (timestep * 8);
 
         auto frameSize = window.GetFramebufferSize();
-        window.MakeContextCurrent();
-        if(!image.IsComplete())
+        if(animating)
         {
-            for(int i=0; i<64; ++i) image.RaytraceLine(scene);
-            glBindTexture(GL_TEXTURE_2D, texture);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image.dimensions.x, image.currentLine, 0, GL_RGB, GL_FLOAT, image.pixels.data());
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            // The scene may only change while the render thread is stopped, and pixels traced before it moved cannot be reprojected
+            renderer.Stop();
+            AnimateScene(scene, timestep);
+            scene.Update();
+            auto reprojection = request.reprojection;
+            request.reprojection = false;
+            startRender();
+            request.reprojection = reprojection;
         }
+        else if(viewPose.position != oldPose.position || viewPose.orientation != oldPose.orientation || frameSize/int2(2,1) != request.dimensions) startRender();
+
+        window.MakeContextCurrent();
+        preview.Upload(renderer.TakeFinishedTiles());
+        renderer.GetRenderTime(renderTime, renderRays);
 
         glPushAttrib(GL_ALL_ATTRIB_BITS);
 
@@ -150,13 +182,12 @@ int main(int argc, char * argv[]) try
         glScissor(0, 0, frameSize.x/2, frameSize.y);
 
         glEnable(GL_TEXTURE_2D);
-        glBindTexture(GL_TEXTURE_2D, texture);
+        glBindTexture(GL_TEXTURE_2D, preview.GetTexture());
         glBegin(GL_QUADS);
-        glTexCoord2f(0,0); glVertex2f(-1,1);
-        glTexCoord2f(1,0); glVertex2f(+1,1);
-        float completion = (float)image.currentLine/image.dimensions.y;
-        glTexCoord2f(1,1); glVertex2f(+1,1-completion*2);
-        glTexCoord2f(0,1); glVertex2f(-1,1-completion*2);
+        glTexCoord2f(0,0); glVertex2f(-1,+1);
+        glTexCoord2f(1,0); glVertex2f(+1,+1);
+        glTexCoord2f(1,1); glVertex2f(+1,-1);
+        glTexCoord2f(0,1); glVertex2f(-1,-1);
         glEnd();
         glDisable(GL_TEXTURE_2D);
 
@@ -179,6 +210,24 @@ int main(int argc, char * argv[]) try
       
         glColor3f(1,1,0);
         window.Print({16,16}, "Press space to raytrace scene");
+        window.Print({16,32}, "Press P to toggle parallel rendering (%s, %d threads)", request.parallel ? "on" : "off", pool.GetThreadCount());
+        window.Print({16,48}, "Press K to change ray packet size (%dx%d)", request.packetSize, request.packetSize);
+        window.Print({16,64}, "Press F to toggle wavefront rendering (%s, %d bounces)", request.wavefront ? "on" : "off", request.maxBounces);
+        window.Print({16,80}, "Press C to toggle compact pixel storage (%s, %s uploads)", request.format == PixelFormat::RGB9E5 ? "RGB9E5" : "float", preview.IsUsingPixelBuffers() ? "PBO" : "direct");
+        window.Print({16,96}, "Press R to toggle reprojection of traced pixels as the camera moves (%s)", request.reprojection ? "on" : "off");
+        window.Print({16,112}, "Press L to rotate the light, or M to change a material, which only shades the traced image again");
+        window.Print({16,128}, "Press G to toggle adaptive antialiasing of edges, once the image is traced (%s)", request.antialias ? request.wavefront ? "not for wavefronts" : "on" : "off");
+        window.Print({16,144}, "Press T to toggle animation, which refits the hierarchies and traces the scene again every frame (%s)", animating ? "on" : "off");
+#ifdef RAYTRACE_STATS
+        window.Print({16,160}, "Press H to toggle the cost heatmap, and [ or ] to change its scale (%s, up to %g tests per pixel)", request.heatmap ? request.wavefront ? "not for wavefronts" : "on" : "off", request.costScale);
+#endif
+        if(renderTime && renderRays) window.Print({16,176}, "Traced %d primary rays in %.3fs (%.2f Mrays/s)", renderRays, renderTime, renderRays / renderTime * 1e-6f);
+        else if(renderTime) window.Print({16,176}, "Shaded again in %.3fs", renderTime);
+#ifdef RAYTRACE_STATS
+        auto counters = GetCounterTotals() - renderCounters;
+        window.Print({16,192}, "%lld rays, %lld shadow rays (%lld ended early), %lld nodes visited", counters[Counter::Rays], counters[Counter::ShadowRays], counters[Counter::ShadowEarlyOuts], counters[Counter::NodeVisits]);
+        window.Print({16,208}, "%lld sphere tests, %lld triangle tests, %lld bounding sphere rejects", counters[Counter::SphereTests], counters[Counter::TriangleTests], counters[Counter::BoundingSphereRejects]);
+#endif
         window.Print({frameSize.x/2+16,16}, "Reference render in OpenGL");
         window.Print({frameSize.x/2+16,32}, "Use W/A/S/D to move and drag left mouse button to look");
         glPopMatrix();
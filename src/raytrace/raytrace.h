@@ -1,7 +1,8 @@
 #pragma once
 
-#include "geometry.h"
+#include "bvh.h"
 #include <algorithm>
+#include <memory>
 #include <vector>
 
 struct Material
@@ -27,10 +28,17 @@ struct Mesh
     Material material;
     std::vector<float3> vertices;
     std::vector<int3> triangles;
+    bool dirty; // Set after changing vertices or triangles
 
     float3 boundCenter;
     float boundRadius;
 
+    std::vector<PrecomputedTriangle> precomputedTriangles; // One per entry in triangles, built by PrecomputeTriangles
+
+    Bvh bvh;                            // Once built, leaves refer to the range of batches [first, first+count)
+    std::vector<TriangleBatch> batches; // Triangles of each leaf, packed for IntersectRayTriangles
+    std::vector<int> batchTriangles;    // Index into triangles for each lane of each batch, or -1 for unused lanes
+
     void ComputeBounds()
     {
         boundCenter = {0,0,0};
@@ -40,29 +48,174 @@ struct Mesh
         for(auto & vert : vertices) boundRadius = std::max(boundRadius, mag(vert - boundCenter));
     }
 
+    void PrecomputeTriangles()
+    {
+        precomputedTriangles.clear();
+        for(auto & tri : triangles) precomputedTriangles.push_back(PrecomputedTriangle(vertices[tri.x], vertices[tri.y], vertices[tri.z]));
+    }
+
+    void BuildBvh(ThreadPool * pool = nullptr)
+    {
+        std::vector<Bounds> bounds(triangles.size());
+        for(size_t i=0; i<triangles.size(); ++i)
+        {
+            bounds[i].Include(vertices[triangles[i].x]);
+            bounds[i].Include(vertices[triangles[i].y]);
+            bounds[i].Include(vertices[triangles[i].z]);
+        }
+        bvh.Build(bounds, SIMD_WIDTH, SIMD_WIDTH, pool);
+
+        batches.clear();
+        batchTriangles.clear();
+        for(auto & node : bvh.nodes)
+        {
+            if(!node.IsLeaf()) continue;
+            int firstBatch = (int)batches.size();
+            for(int i=0; i<node.count; i+=SIMD_WIDTH)
+            {
+                TriangleBatch batch;
+                for(int lane=0; lane<SIMD_WIDTH; ++lane)
+                {
+                    int index = i+lane < node.count ? bvh.indices[node.first+i+lane] : -1;
+                    if(index >= 0) batch.SetTriangle(lane, precomputedTriangles[index]);
+                    batchTriangles.push_back(index);
+                }
+                batches.push_back(batch);
+            }
+            node.first = firstBatch;
+            node.count = (int)batches.size() - firstBatch;
+        }
+        bvh.buildCost = bvh.GetCost(); // Leaves now count batches rather than triangles, as they will after refitting
+    }
+
+    // Updates the hierarchy after vertices have moved, without changing its structure, which is only valid if the triangles are unchanged
+    void RefitBvh()
+    {
+        for(size_t i=0; i<batches.size(); ++i)
+        {
+            for(int lane=0; lane<SIMD_WIDTH; ++lane)
+            {
+                int index = batchTriangles[i*SIMD_WIDTH + lane];
+                if(index >= 0) batches[i].SetTriangle(lane, precomputedTriangles[index]);
+            }
+        }
+        bvh.Refit([this](const BvhNode & leaf)
+        {
+            Bounds bounds;
+            for(int i=leaf.first*SIMD_WIDTH; i<(leaf.first+leaf.count)*SIMD_WIDTH; ++i)
+            {
+                int index = batchTriangles[i];
+                if(index < 0) continue;
+                bounds.Include(vertices[triangles[index].x]);
+                bounds.Include(vertices[triangles[index].y]);
+                bounds.Include(vertices[triangles[index].z]);
+            }
+            return bounds;
+        });
+    }
+
     bool CheckOcclusion(const Ray & ray) const 
     {
-        if(!IntersectRaySphere(ray, boundCenter, boundRadius)) return false;
-        for(auto & tri : triangles) if(IntersectRayTriangle(ray, vertices[tri.x], vertices[tri.y], vertices[tri.z])) return true;
-        return false;
+        if(bvh.nodes.empty())
+        {
+            if(!IntersectRaySphere(ray, boundCenter, boundRadius))
+            {
+                RAYTRACE_COUNT(BoundingSphereRejects, 1);
+                return false;
+            }
+            for(auto & tri : precomputedTriangles)
+            {
+                RAYTRACE_COUNT(TriangleTests, 1);
+                if(IntersectRayTriangle(ray, tri)) return true;
+            }
+            return false;
+        }
+
+        return bvh.Traverse(ray, std::numeric_limits<float>::infinity(), [&](const BvhNode & leaf, float &)
+        {
+            for(int i=leaf.first; i<leaf.first+leaf.count; ++i)
+            {
+                RAYTRACE_COUNT(TriangleTests, SIMD_WIDTH);
+                if(IntersectRayTriangles(ray, batches[i], std::numeric_limits<float>::infinity()) >= 0) return true;
+            }
+            return false;
+        });
     }
-    Hit Intersect(const Ray & ray) const
+    Hit Intersect(const Ray & ray, float maxT = std::numeric_limits<float>::infinity()) const
     {
-        if(!IntersectRaySphere(ray, boundCenter, boundRadius)) return Hit();
-        const int3 * bestTri = 0;
-        float bestT = std::numeric_limits<float>::infinity();
-        for(auto & tri : triangles)
+        const PrecomputedTriangle * bestTri = 0;
+        float bestT = maxT;
+        if(bvh.nodes.empty())
         {
-            float t;
-            if(IntersectRayTriangle(ray, vertices[tri.x], vertices[tri.y], vertices[tri.z], &t))
-            if(t < bestT)
+            if(!IntersectRaySphere(ray, boundCenter, boundRadius))
             {
-                bestTri = &tri;
-                bestT = t;
+                RAYTRACE_COUNT(BoundingSphereRejects, 1);
+                return Hit();
+            }
+            RAYTRACE_COUNT(TriangleTests, precomputedTriangles.size());
+            for(auto & tri : precomputedTriangles)
+            {
+                float t;
+                if(IntersectRayTriangle(ray, tri, &t))
+                if(t < bestT)
+                {
+                    bestTri = &tri;
+                    bestT = t;
+                }
             }
         }
-        return bestTri ? Hit(bestT, norm(cross(vertices[bestTri->y] - vertices[bestTri->x], vertices[bestTri->z] - vertices[bestTri->x])), &material) : Hit();
+        else bvh.Traverse(ray, bestT, [&](const BvhNode & leaf, float & leafMaxT)
+        {
+            RAYTRACE_COUNT(TriangleTests, leaf.count * SIMD_WIDTH);
+            for(int i=leaf.first; i<leaf.first+leaf.count; ++i)
+            {
+                float t;
+                int lane = IntersectRayTriangles(ray, batches[i], bestT, &t);
+                if(lane >= 0)
+                {
+                    bestTri = &precomputedTriangles[batchTriangles[i*SIMD_WIDTH + lane]];
+                    bestT = leafMaxT = t;
+                }
+            }
+            return false;
+        });
+        return bestTri ? Hit(bestT, bestTri->normal, &material) : Hit();
+    }
+
+    // Packet versions of CheckOcclusion and Intersect, which only consider the rays in mask. CheckOcclusionPacket returns the occluded rays,
+    // while IntersectPacket replaces the entries of hits and maxT for rays which hit the mesh nearer than their entry in maxT.
+    uint64_t CheckOcclusionPacket(const RayPacket & packet, uint64_t mask) const;
+    void IntersectPacket(const RayPacket & packet, uint64_t mask, float * maxT, Hit * hits) const;
+};
+
+// Places a mesh which may be shared with other instances. Rays are transformed into the space of the mesh as they reach it, so that its triangles
+// and hierarchy are only stored once. The instance's own material is used in place of the mesh's, so that rays leaving one instance still hit others.
+struct MeshInstance
+{
+    Material material;
+    std::shared_ptr<Mesh> mesh; // Built by Scene::BuildBvh, only once however many instances share it
+    Pose pose;
+    bool dirty; // Set after changing the pose
+
+    Bounds GetBounds() const
+    {
+        Bounds bounds, meshBounds = mesh->bvh.nodes.empty() ? Bounds() : mesh->bvh.nodes[0].bounds;
+        if(meshBounds.IsEmpty()) return bounds;
+        for(int i=0; i<8; ++i) bounds.Include(pose.TransformPoint({i&1 ? meshBounds.max.x : meshBounds.min.x, i&2 ? meshBounds.max.y : meshBounds.min.y, i&4 ? meshBounds.max.z : meshBounds.min.z}));
+        return bounds;
     }
+
+    bool CheckOcclusion(const Ray & ray) const { return mesh->CheckOcclusion(pose.GetInverse() * ray); }
+    Hit Intersect(const Ray & ray, float maxT = std::numeric_limits<float>::infinity()) const
+    {
+        // Poses do not scale, so distances are the same in both spaces
+        auto hit = mesh->Intersect(pose.GetInverse() * ray, maxT);
+        if(!hit.IsHit()) return hit;
+        return Hit(hit.distance, pose.TransformDirection(hit.normal), &material);
+    }
+
+    uint64_t CheckOcclusionPacket(const RayPacket & packet, uint64_t mask) const;
+    void IntersectPacket(const RayPacket & packet, uint64_t mask, float * maxT, Hit * hits) const;
 };
 
 struct Sphere
@@ -70,13 +223,22 @@ struct Sphere
     Material material;
     float3 position;
     float radius;
+    bool dirty; // Set after changing the position or radius
 
-    bool CheckOcclusion(const Ray & ray) const { return IntersectRaySphere(ray, position, radius); }
+    bool CheckOcclusion(const Ray & ray) const
+    {
+        RAYTRACE_COUNT(SphereTests, 1);
+        return IntersectRaySphere(ray, position, radius);
+    }
     Hit Intersect(const Ray & ray) const
     {
+        RAYTRACE_COUNT(SphereTests, 1);
         float t; float3 normal;
         return IntersectRaySphere(ray, position, radius, &t, &normal) ? Hit(t, normal, &material) : Hit();
     }
+
+    uint64_t CheckOcclusionPacket(const RayPacket & packet, uint64_t mask) const;
+    void IntersectPacket(const RayPacket & packet, uint64_t mask, float * maxT, Hit * hits) const;
 };
 
 struct DirectionalLight
@@ -87,6 +249,8 @@ struct DirectionalLight
     float3 ComputeContribution(const Hit & hit, const float3 & eyeDir) const;
 };
 
+class PagedMesh;
+
 struct Scene
 {
     float3 skyColor;
@@ -95,34 +259,55 @@ struct Scene
 
     std::vector<Sphere> spheres;
     std::vector<Mesh> meshes;
+    std::vector<MeshInstance> instances;
+    std::vector<std::shared_ptr<PagedMesh>> pagedMeshes; // Tested after every other object, outside the top-level hierarchy, and never updated
+
+    Bvh bvh; // Top-level hierarchy over object bounds, indexing spheres first, then meshes, then instances
+
+    // Builds the hierarchy of every mesh, followed by the top-level hierarchy. Until this is called, rays are tested against every object. If a
+    // pool is given, each hierarchy is built in parallel on it.
+    void BuildBvh(ThreadPool * pool = nullptr);
+
+    // Brings the hierarchies up to date after changes to objects marked dirty, and clears their flags, in time proportional to the size of the
+    // hierarchies affected. Hierarchies are refitted rather than rebuilt, unless this has made them much worse than rebuilt ones, or the number of
+    // triangles in a mesh has changed. Returns true if anything had changed.
+    bool Update();
+    std::vector<Bounds> GetObjectBounds() const; // Indexed as in bvh
 
     float3 ComputeLighting(const Hit & hit, const float3 & viewPosition) const;
+    float3 ComputeLighting(const Hit & hit, const float3 & viewPosition, bool occluded) const; // For callers which have already traced the shadow ray
 
-    bool CheckOcclusion(const Ray & ray, const Material * ignore) const
-    {
-        for(auto & sphere : spheres) if(&sphere.material != ignore && sphere.CheckOcclusion(ray)) return true;
-        for(auto & mesh : meshes) if(&mesh.material != ignore && mesh.CheckOcclusion(ray)) return true;
-        return false;
-    }
+    bool CheckOcclusion(const Ray & ray, const Material * ignore) const;
+    Hit Intersect(const Ray & ray, const Material * ignore = 0) const;
+
+    // Traces every ray of a packet together, sharing bounding volume tests between them. ignore may be null, or hold one material per ray.
+    uint64_t CheckOcclusionPacket(const RayPacket & packet, const Material * const * ignore) const;
+    void IntersectPacket(const RayPacket & packet, const Material * const * ignore, Hit * hits) const;
+
+    // Traces count rays in one call, which lets the scene reorder them into coherent packets. ignore may be null, or hold one material per ray.
+    // CheckOcclusionStream sets bit i%64 of occluded[i/64] if ray i is occluded, and clears it otherwise.
+    void CheckOcclusionStream(const Ray * rays, const Material * const * ignore, size_t count, uint64_t * occluded) const;
+    void IntersectStream(const Ray * rays, const Material * const * ignore, size_t count, Hit * hits) const;
 
     float3 CastPrimaryRay(const Ray & ray, const Material * ignore = 0) const
     {
-        Hit bestHit;
-        for(auto & sphere : spheres)
-        {
-            if(&sphere.material == ignore) continue;
-            auto hit = sphere.Intersect(ray);
-            if(hit.distance < bestHit.distance) bestHit = hit;
-        }
-        for(auto & mesh : meshes)
-        {
-            if(&mesh.material == ignore) continue;
-            auto hit = mesh.Intersect(ray);
-            if(hit.distance < bestHit.distance) bestHit = hit;
-        }
-        bestHit.point = ray.origin + ray.direction * bestHit.distance;
-        return bestHit.IsHit() ? ComputeLighting(bestHit, ray.origin) : skyColor;
+        auto hit = Intersect(ray, ignore);
+        return hit.IsHit() ? ComputeLighting(hit, ray.origin) : skyColor;
     }
 };
 
+Scene CreateExampleScene();
+Scene CreateForestScene(int size); // A size x size grid of instances of one mesh
+Scene CreateModelScene(std::shared_ptr<Mesh> model); // The model standing on a ground plane, placed to fill the view of the default pose
+Scene CreatePagedModelScene(std::shared_ptr<PagedMesh> model); // As CreateModelScene, setting the pose of the model
+
+// Advances the motion of a scene by the given time, marking what moves as dirty: pairs of spheres and of instances circle each other, and the mesh of
+// the first instance, or else the last mesh, is twisted about its center. Animating in the same steps always gives the same scene.
+void AnimateScene(Scene & scene, float seconds);
+
+// Scenes for measuring performance, the same on every platform for a given parameter
+Scene CreateSpheresScene(int count, float reflectivity); // Randomly placed spheres above a ground plane, all with the given reflectivity
+Scene CreateTrianglesScene(int count);                    // One mesh of about count triangles, as placed by CreateModelScene
+Scene CreateCanopyScene(int count);                       // A layer of count small triangles between the ground and the light, so that most shadow rays pass through it
+
 void DrawReferenceSceneGL(const Scene & scene, const Pose & viewPose, float aspectRatio);
\ No newline at end of file
@@ -30,6 +30,21 @@ void SetupMaterial(const Material & material)
     glMateriali(GL_FRONT, GL_SHININESS, 64);
 }
 
+void DrawMesh(const Mesh & mesh)
+{
+    glBegin(GL_TRIANGLES);
+    for(auto & tri : mesh.triangles)
+    {
+        auto & v0 = mesh.vertices[tri.x], & v1 = mesh.vertices[tri.y], & v2 = mesh.vertices[tri.z];
+        auto n = norm(cross(v1-v0, v2-v0));
+        glNormal3fv(&n.x);
+        glVertex3fv(&v0.x);
+        glVertex3fv(&v1.x);
+        glVertex3fv(&v2.x);
+    }
+    glEnd();
+}
+
 void DrawReferenceSceneGL(const Scene & scene, const Pose & viewPose, float aspectRatio)
 {
     static GLUquadric * quad = gluNewQuadric();
@@ -65,18 +80,20 @@ void DrawReferenceSceneGL(const Scene & scene, const Pose & viewPose, float aspe
     for(auto & mesh : scene.meshes)
     {
         SetupMaterial(mesh.material);
+        DrawMesh(mesh);
+    }
+
+    for(auto & instance : scene.instances)
+    {
+        SetupMaterial(instance.material);
 
-        glBegin(GL_TRIANGLES);
-        for(auto & tri : mesh.triangles)
-        {
-            auto & v0 = mesh.vertices[tri.x], & v1 = mesh.vertices[tri.y], & v2 = mesh.vertices[tri.z];
-            auto n = norm(cross(v1-v0, v2-v0));
-            glNormal3fv(&n.x);
-            glVertex3fv(&v0.x);
-            glVertex3fv(&v1.x);
-            glVertex3fv(&v2.x);
-        }
-        glEnd();
+        auto & q = instance.pose.orientation;
+        float sinHalfAngle = mag(float3(q.x, q.y, q.z));
+        glPushMatrix();
+        glTranslatef(instance.pose.position.x, instance.pose.position.y, instance.pose.position.z);
+        if(sinHalfAngle > 0) glRotatef(std::atan2(sinHalfAngle, q.w) * 2 * 57.2957795f, q.x, q.y, q.z);
+        DrawMesh(*instance.mesh);
+        glPopMatrix();
     }
 
     glPopMatrix();
@@ -0,0 +1,144 @@
+#include "render-thread.h"
+
+#include <chrono>
+
+RenderThread::RenderThread(const Scene & scene, ThreadPool & pool) : scene(scene), pool(pool), epoch(0), completedEpoch(0), completedRays(0), completedSeconds(0), hasRequest(false), rendering(false), stopping(false)
+{
+    thread = std::thread(&RenderThread::ThreadMain, this);
+}
+
+RenderThread::~RenderThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    image.cancelled = true;
+    requestCondition.notify_one();
+    thread.join();
+}
+
+void RenderThread::Start(const RenderRequest & request)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->request = request;
+        hasRequest = true;
+        ++epoch;
+        finishedTiles.clear();
+    }
+
+    // Tiles already running finish normally, but their results are discarded, as they no longer belong to the current epoch
+    image.cancelled = true;
+    requestCondition.notify_one();
+}
+
+void RenderThread::Stop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    hasRequest = false;
+    ++epoch;
+    finishedTiles.clear();
+    image.cancelled = true;
+    idleCondition.wait(lock, [this]() { return !rendering; });
+}
+
+std::vector<ConvertedTile> RenderThread::TakeFinishedTiles()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<ConvertedTile> tiles;
+    tiles.swap(finishedTiles);
+    return tiles;
+}
+
+bool RenderThread::GetRenderTime(float & seconds, int & primaryRays)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(completedEpoch != epoch) return false;
+    seconds = completedSeconds;
+    primaryRays = completedRays;
+    return true;
+}
+
+bool RenderThread::IsCurrent(int epoch)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return epoch == this->epoch;
+}
+
+void RenderThread::Render(const RenderRequest & request, int epoch)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Settings may only change once no thread is tracing the previous image
+    image.Cancel();
+    image.format = request.format;
+    image.packetSize = request.packetSize;
+    image.reprojection = request.reprojection && !request.wavefront; // The wavefront renderer traces every pixel regardless
+    image.keepHits = !request.wavefront;
+    image.recordCosts = request.heatmap && !request.wavefront;
+    image.costScale = request.costScale;
+    bool encodeSrgb = request.encodeSrgb;
+    image.onTileFinished = [this, epoch, encodeSrgb](const Tile & tile)
+    {
+        auto converted = image.ConvertToSrgb8(tile, encodeSrgb);
+        std::lock_guard<std::mutex> lock(mutex);
+        if(epoch == this->epoch) finishedTiles.push_back(std::move(converted));
+    };
+
+    if(request.wavefront)
+    {
+        image.Reset(request.dimensions, request.viewPose, request.dimensions);
+        if(!IsCurrent(epoch)) return;
+        wavefront.maxDepth = request.maxBounces;
+        wavefront.Render(scene, image, request.parallel ? &pool : nullptr); // Returns early, leaving the image incomplete, once Start or Stop sets cancelled
+    }
+    else
+    {
+        auto tileSize = request.parallel ? int2(32,32) : int2(request.dimensions.x,8);
+        bool sameView = request.dimensions == image.dimensions && request.viewPose.position == image.viewPose.position && request.viewPose.orientation == image.viewPose.orientation;
+        if(request.lightingOnly && !request.heatmap && sameView && image.HasCompleteHits()) image.ResetLighting(tileSize, request.shadowsChanged); // Relighting would not record costs
+        else image.Reset(request.dimensions, request.viewPose, tileSize, 8);
+        if(!IsCurrent(epoch)) return; // Reset clears cancelled, which Start may have set in the meantime
+        if(request.parallel)
+        {
+            image.RaytraceParallel(scene, pool);
+            image.Wait();
+        }
+        else while(!image.IsComplete() && IsCurrent(epoch)) image.RaytraceNextTile(scene);
+    }
+
+    // Antialiasing only begins once every pixel has been traced, and is abandoned along with the image if another request starts
+    AntialiasSettings antialias;
+    int antialiasedPixels = request.antialias && !request.wavefront && IsCurrent(epoch) ? image.Antialias(scene, request.parallel ? &pool : nullptr, antialias) : 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if(image.IsComplete() && epoch == this->epoch)
+    {
+        completedEpoch = epoch;
+        completedRays = (image.relighting ? 0 : image.GetPixelCount() - image.reusedPixelCount) + antialiasedPixels * antialias.gridSize * antialias.gridSize;
+        completedSeconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+}
+
+void RenderThread::ThreadMain()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true)
+    {
+        requestCondition.wait(lock, [this]() { return stopping || hasRequest; });
+        if(stopping) break;
+
+        auto request = this->request;
+        int epoch = this->epoch;
+        hasRequest = false;
+        rendering = true;
+        lock.unlock();
+        Render(request, epoch);
+        lock.lock();
+        rendering = false;
+        idleCondition.notify_all();
+    }
+    lock.unlock();
+    image.Cancel();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "wavefront.h"
+
+// Everything needed to trace one image from scratch
+struct RenderRequest
+{
+    int2 dimensions;
+    Pose viewPose;
+    bool parallel, wavefront, reprojection;
+    int packetSize, maxBounces;
+    PixelFormat format;
+    bool lightingOnly;   // Only lights or materials have changed since the previous request, so its primary hits may be shaded again
+    bool shadowsChanged; // With lightingOnly, the light direction has changed, so shadow rays must be traced again
+    bool heatmap;        // Show the cost of each pixel in place of its color, unless tracing wavefronts, which cannot attribute work to pixels
+    float costScale;     // Cost at the hot end of the heatmap
+    bool antialias;      // Once traced, supersample edges and pixels of high contrast, unless tracing wavefronts
+    bool encodeSrgb;     // Finished tiles are converted to 8-bit sRGB, or to linear 8-bit values for a preview texture which cannot decode sRGB
+};
+
+// Owns a RaytracedImage and traces it on a dedicated thread, so that the thread running the event loop never waits on tracing. Each call to
+// Start begins a new epoch, which abandons any render in progress without blocking. Tiles are converted to sRGB as they finish, on whichever
+// thread traced them, and queued for TakeFinishedTiles only if they still belong to the current epoch.
+class RenderThread
+{
+    const Scene & scene;
+    ThreadPool & pool;
+    RaytracedImage image;
+    WavefrontRenderer wavefront;
+
+    std::mutex mutex;
+    std::condition_variable requestCondition, idleCondition;
+    RenderRequest request;
+    int epoch, completedEpoch, completedRays;
+    float completedSeconds;
+    bool hasRequest, rendering, stopping;
+    std::vector<ConvertedTile> finishedTiles;
+    std::thread thread;
+
+    RenderThread(const RenderThread &); // Noncopyable
+
+    bool IsCurrent(int epoch);
+    void Render(const RenderRequest & request, int epoch);
+    void ThreadMain();
+public:
+    RenderThread(const Scene & scene, ThreadPool & pool);
+    ~RenderThread();
+
+    void Start(const RenderRequest & request);
+
+    // Abandons the current request, returning once the scene is no longer in use, so that it may be edited before the next call to Start
+    void Stop();
+
+    // Returns the tiles of the most recent request which have finished since the last call
+    std::vector<ConvertedTile> TakeFinishedTiles();
+
+    // Returns true, with the time taken and the number of primary rays traced, if the most recent request has been completely traced
+    bool GetRenderTime(float & seconds, int & primaryRays);
+};
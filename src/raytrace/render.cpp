@@ -0,0 +1,202 @@
+#include "mesh-loader.h"
+#include "paged-mesh.h"
+#include "scene-cache.h"
+#include "stats.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+static const char * usage = "Usage: render [-w width] [-h height] [-t threads] [-s tile-size] [-k packet-size] [-b max-bounces] [-f forest-size] [-m model.obj|model.ply] [-c scene-cache] [-p paged-mesh] [-r resident-megabytes] [-j stats.json] [-x costs.pfm|costs.ppm] [-a antialias-grid-size] [-e antialias-samples-per-pixel] output.pfm|output.ppm";
+
+static float GetSeconds(std::chrono::high_resolution_clock::time_point since)
+{
+    return std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - since).count();
+}
+
+int main(int argc, char * argv[]) try
+{
+    int2 dimensions = {1280,720};
+    int threads = std::thread::hardware_concurrency(), tileSize = 32, packetSize = 1, maxBounces = -1, forestSize = 0, residentMegabytes = 256; // Tiles are traced recursively unless a bounce limit selects the wavefront renderer
+    std::string output, cacheFile, modelFile, pagedFile, statsFile, costsFile;
+    AntialiasSettings antialias;
+    antialias.gridSize = 0; // Antialiasing is off unless a grid size is given
+    for(int i=1; i<argc; ++i)
+    {
+        if(strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "-x") == 0)
+        {
+            if(i+1 == argc) throw std::runtime_error(usage);
+            auto & value = strcmp(argv[i], "-c") == 0 ? cacheFile : strcmp(argv[i], "-m") == 0 ? modelFile : strcmp(argv[i], "-p") == 0 ? pagedFile : strcmp(argv[i], "-j") == 0 ? statsFile : costsFile;
+            value = argv[++i];
+        }
+        else if(strcmp(argv[i], "-e") == 0)
+        {
+            if(i+1 == argc) throw std::runtime_error(usage);
+            antialias.sampleBudget = (float)atof(argv[++i]);
+            if(!(antialias.sampleBudget >= 0)) throw std::runtime_error(usage);
+        }
+        else if(argv[i][0] == '-')
+        {
+            if(i+1 == argc) throw std::runtime_error(usage);
+            int value = atoi(argv[++i]);
+            if(value < 0) throw std::runtime_error(usage);
+            if(strcmp(argv[i-1], "-b") == 0) maxBounces = value;
+            else if(value == 0) throw std::runtime_error(usage);
+            else if(strcmp(argv[i-1], "-w") == 0) dimensions.x = value;
+            else if(strcmp(argv[i-1], "-h") == 0) dimensions.y = value;
+            else if(strcmp(argv[i-1], "-t") == 0) threads = value;
+            else if(strcmp(argv[i-1], "-s") == 0) tileSize = value;
+            else if(strcmp(argv[i-1], "-k") == 0 && value*value <= RayPacket::MaxSize) packetSize = value;
+            else if(strcmp(argv[i-1], "-f") == 0) forestSize = value;
+            else if(strcmp(argv[i-1], "-r") == 0) residentMegabytes = value;
+            else if(strcmp(argv[i-1], "-a") == 0 && value*value <= RayPacket::MaxSize) antialias.gridSize = value;
+            else throw std::runtime_error(usage);
+        }
+        else if(output.empty()) output = argv[i];
+        else throw std::runtime_error(usage);
+    }
+    auto extension = output.size() > 4 ? output.substr(output.size() - 4) : std::string();
+    if(extension != ".pfm" && extension != ".ppm") throw std::runtime_error(usage);
+    auto costsExtension = costsFile.size() > 4 ? costsFile.substr(costsFile.size() - 4) : std::string();
+    if(!costsFile.empty() && costsExtension != ".pfm" && costsExtension != ".ppm") throw std::runtime_error(usage);
+
+    // Costs are counted per thread, so are only known for pixels traced by the recursive renderer, with counting compiled in
+#ifndef RAYTRACE_STATS
+    if(!costsFile.empty()) throw std::runtime_error("Costs are only recorded by builds which define RAYTRACE_STATS.");
+#endif
+    if(!costsFile.empty() && maxBounces >= 0) throw std::runtime_error("Costs cannot be recorded by the wavefront renderer.");
+    bool antialiasing = antialias.gridSize > 1;
+    if(antialiasing && maxBounces >= 0) throw std::runtime_error("Antialiasing is not supported by the wavefront renderer, whose bounce limit it would not respect.");
+
+    // A paged mesh is written from the model the first time, then traced from its file, keeping no more than the given size of it in memory.
+    // A scene cache, once written, is loaded in place of building the scene, whichever scene was requested.
+    ThreadPool pool(threads);
+    Scene scene;
+    std::shared_ptr<PagedMesh> pagedMesh;
+    auto t0 = std::chrono::high_resolution_clock::now();
+    if(!pagedFile.empty())
+    {
+        if(!std::ifstream(pagedFile.c_str()))
+        {
+            if(modelFile.empty()) throw std::runtime_error(pagedFile + " does not exist, and there is no model to write it from.");
+            Mesh model = {};
+            LoadMesh(model, modelFile.c_str(), &pool);
+            model.ComputeBounds();
+            model.PrecomputeTriangles();
+            model.BuildBvh(&pool);
+            WritePagedMesh(model, pagedFile.c_str());
+            std::cout << "Wrote " << model.triangles.size() << " triangles from " << modelFile << " to " << pagedFile << " in " << GetSeconds(t0) * 1000 << " ms" << std::endl;
+            t0 = std::chrono::high_resolution_clock::now();
+        }
+        pagedMesh = std::make_shared<PagedMesh>(pagedFile.c_str(), (size_t)residentMegabytes << 20);
+        pagedMesh->material = {{0.8f,0.8f,0.8f}};
+        scene = CreatePagedModelScene(pagedMesh);
+        scene.BuildBvh(&pool);
+        std::cout << "Opened " << pagedFile << " with " << pagedMesh->GetBlockCount() << " blocks in " << GetSeconds(t0) * 1000 << " ms" << std::endl;
+    }
+    else if(!cacheFile.empty() && LoadSceneCache(scene, cacheFile.c_str())) std::cout << "Loaded scene from " << cacheFile << " in " << GetSeconds(t0) * 1000 << " ms" << std::endl;
+    else
+    {
+        if(!modelFile.empty())
+        {
+            auto model = std::make_shared<Mesh>();
+            model->material = {{0.8f,0.8f,0.8f}};
+            LoadMesh(*model, modelFile.c_str(), &pool);
+            std::cout << "Loaded " << model->triangles.size() << " triangles from " << modelFile << " in " << GetSeconds(t0) * 1000 << " ms" << std::endl;
+            scene = CreateModelScene(model);
+        }
+        else scene = forestSize ? CreateForestScene(forestSize) : CreateExampleScene();
+        float createTime = GetSeconds(t0);
+        t0 = std::chrono::high_resolution_clock::now();
+        scene.BuildBvh(&pool);
+        float buildTime = GetSeconds(t0);
+
+        // Tree quality is the expected cost of tracing a ray through each hierarchy, averaged over meshes by their number of triangles
+        std::vector<const Mesh *> meshes;
+        for(auto & mesh : scene.meshes) meshes.push_back(&mesh);
+        for(auto & instance : scene.instances) if(std::find(begin(meshes), end(meshes), instance.mesh.get()) == end(meshes)) meshes.push_back(instance.mesh.get());
+        size_t triangleCount = 0;
+        float meshCost = 0;
+        for(auto mesh : meshes)
+        {
+            triangleCount += mesh->triangles.size();
+            meshCost += mesh->bvh.buildCost * mesh->triangles.size();
+        }
+        std::cout << "Created scene in " << createTime * 1000 << " ms, built hierarchies on " << pool.GetThreadCount() << " threads in " << buildTime * 1000 << " ms ("
+            << triangleCount / std::max(buildTime, 1e-6f) * 1e-6f << " M triangles/s, SAH cost " << scene.bvh.buildCost << " top-level, " << (triangleCount ? meshCost / triangleCount : 0) << " per mesh)" << std::endl;
+
+        if(!cacheFile.empty())
+        {
+            SaveSceneCache(scene, cacheFile.c_str());
+            std::cout << "Wrote " << cacheFile << std::endl;
+        }
+    }
+
+    RaytracedImage image;
+    image.packetSize = packetSize;
+    image.recordCosts = !costsFile.empty();
+    image.keepHits = antialiasing; // Lets Antialias find geometric edges as well as contrast
+    auto countersBefore = GetCounterTotals();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    image.Reset(dimensions, Pose(), {tileSize,tileSize});
+    if(maxBounces >= 0)
+    {
+        WavefrontRenderer renderer;
+        renderer.maxDepth = maxBounces;
+        renderer.Render(scene, image, &pool);
+        float renderTime = GetSeconds(t1);
+        std::cout << "Traced " << dimensions.x << "x" << dimensions.y << " wavefront with up to " << maxBounces << " bounces on " << pool.GetThreadCount() << " threads in " << renderTime << " s ("
+            << renderer.pathRayCount << " path rays, " << renderer.shadowRayCount << " shadow rays, " << (renderer.pathRayCount + renderer.shadowRayCount) / renderTime * 1e-6f << " M rays/s)" << std::endl;
+    }
+    else
+    {
+        image.RaytraceParallel(scene, pool);
+        image.Wait();
+        float renderTime = GetSeconds(t1);
+        std::cout << "Traced " << dimensions.x << "x" << dimensions.y << " on " << pool.GetThreadCount() << " threads with " << packetSize << "x" << packetSize << " packets in " << renderTime << " s ("
+            << image.GetPixelCount() / renderTime * 1e-6f << " M primary rays/s)" << std::endl;
+    }
+    if(antialiasing)
+    {
+        auto t2 = std::chrono::high_resolution_clock::now();
+        int pixelCount = image.Antialias(scene, &pool, antialias);
+        std::cout << "Antialiased " << pixelCount << " pixels (" << pixelCount * 100.0f / image.GetPixelCount() << "%) with " << antialias.gridSize << "x" << antialias.gridSize << " samples in "
+            << GetSeconds(t2) << " s, " << (float)pixelCount * antialias.gridSize * antialias.gridSize / image.GetPixelCount() << " samples per pixel beyond the first" << std::endl;
+    }
+
+    // Counters are only compiled into builds which define RAYTRACE_STATS, and are otherwise written as zero
+    auto counters = GetCounterTotals() - countersBefore;
+#ifdef RAYTRACE_STATS
+    std::cout << "Counted";
+    for(int i=0; i<(int)Counter::Count; ++i) std::cout << (i ? ", " : " ") << counters.values[i] << " " << GetCounterName((Counter)i);
+    std::cout << std::endl;
+#endif
+    if(!statsFile.empty())
+    {
+        SaveCounters(counters, statsFile.c_str());
+        std::cout << "Wrote " << statsFile << std::endl;
+    }
+    if(pagedMesh) std::cout << "Loaded " << pagedMesh->GetLoadCount() << " blocks of " << pagedMesh->GetBlockCount() << ", leaving " << pagedMesh->GetResidentBytes() / (1 << 20) << " MB resident" << std::endl;
+
+    if(extension == ".pfm") image.SavePFM(output.c_str());
+    else image.SavePPM(output.c_str());
+    std::cout << "Wrote " << output << std::endl;
+    if(!costsFile.empty())
+    {
+        if(costsExtension == ".pfm") image.SaveCostsPFM(costsFile.c_str());
+        else image.SaveCostsPPM(costsFile.c_str());
+        std::cout << "Wrote " << costsFile << std::endl;
+    }
+    return 0;
+}
+catch(const std::exception & e)
+{
+    std::cerr << e.what() << std::endl;
+    return -1;
+}
@@ -0,0 +1,220 @@
+#include "scene-cache.h"
+#include "mapped-file.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    // Arrays start on cache line boundaries, so that their contents are aligned for SIMD loads wherever they are read from
+    const size_t arrayAlignment = 64;
+
+    // Must be incremented whenever the file layout changes, including the layout of any structure stored in it
+    const uint32_t cacheVersion = 1;
+
+    struct CacheHeader
+    {
+        char magic[4];
+        uint32_t version, simdWidth;
+        uint32_t nodeSize, batchSize, sphereSize; // Structure sizes, which catch changes in layout between compilers and platforms
+        uint32_t sphereCount, meshCount, sharedMeshCount, instanceCount;
+    };
+
+    struct MeshRecord
+    {
+        Material material;
+        float3 boundCenter;
+        float boundRadius, buildCost;
+    };
+
+    struct InstanceRecord
+    {
+        Material material;
+        Pose pose;
+        uint32_t sharedMesh; // Index of the mesh among those stored after the scene's own meshes
+    };
+
+    CacheHeader GetExpectedHeader()
+    {
+        CacheHeader header = {{'R','T','S','C'}, cacheVersion, SIMD_WIDTH, sizeof(BvhNode), sizeof(TriangleBatch), sizeof(Sphere)};
+        return header;
+    }
+
+    class CacheWriter
+    {
+        std::ofstream out;
+        const char * filename;
+        size_t position;
+    public:
+        CacheWriter(const char * filename) : out(filename, std::ofstream::binary), filename(filename), position(0) { Check(); }
+
+        void Check() { if(!out) throw std::runtime_error(std::string("Unable to write ") + filename + "."); }
+
+        void Write(const void * data, size_t size)
+        {
+            out.write(reinterpret_cast<const char *>(data), size);
+            position += size;
+        }
+        template<class T> void Write(const T & value) { Write(&value, sizeof(T)); }
+        template<class T> void WriteArray(const std::vector<T> & values)
+        {
+            Write<uint64_t>(values.size());
+            static const char padding[arrayAlignment] = {};
+            Write(padding, (arrayAlignment - position % arrayAlignment) % arrayAlignment);
+            Write(values.data(), values.size() * sizeof(T));
+        }
+    };
+
+    class CacheReader
+    {
+        const uint8_t * data;
+        size_t size, position;
+        const char * filename;
+
+        void FailTruncated() const { throw std::runtime_error(std::string("Scene cache ") + filename + " is truncated."); }
+
+        const uint8_t * Take(size_t count)
+        {
+            if(!CanRead(count)) FailTruncated();
+            auto begin = data + position;
+            position += count;
+            return begin;
+        }
+    public:
+        CacheReader(const MappedFile & file, const char * filename) : data(file.GetData()), size(file.GetSize()), position(0), filename(filename) {}
+
+        bool CanRead(size_t count) const { return count <= size - position; }
+
+        template<class T> void Read(T & value) { memcpy(&value, Take(sizeof(T)), sizeof(T)); }
+        template<class T> void ReadArray(std::vector<T> & values)
+        {
+            uint64_t count;
+            Read(count);
+            Take((arrayAlignment - position % arrayAlignment) % arrayAlignment);
+            if(count > (size - position) / sizeof(T)) FailTruncated(); // Checked before multiplying, which a corrupt count could overflow
+            auto begin = reinterpret_cast<const T *>(Take((size_t)count * sizeof(T)));
+            values.assign(begin, begin + count);
+        }
+    };
+
+    void WriteBvh(CacheWriter & writer, const Bvh & bvh)
+    {
+        writer.Write(bvh.buildCost);
+        writer.WriteArray(bvh.nodes);
+        writer.WriteArray(bvh.indices);
+    }
+
+    void ReadBvh(CacheReader & reader, Bvh & bvh)
+    {
+        reader.Read(bvh.buildCost);
+        reader.ReadArray(bvh.nodes);
+        reader.ReadArray(bvh.indices);
+    }
+
+    void WriteMesh(CacheWriter & writer, const Mesh & mesh)
+    {
+        MeshRecord record = {mesh.material, mesh.boundCenter, mesh.boundRadius, mesh.bvh.buildCost};
+        writer.Write(record);
+        writer.WriteArray(mesh.vertices);
+        writer.WriteArray(mesh.triangles);
+        writer.WriteArray(mesh.precomputedTriangles);
+        writer.WriteArray(mesh.bvh.nodes);
+        writer.WriteArray(mesh.bvh.indices);
+        writer.WriteArray(mesh.batches);
+        writer.WriteArray(mesh.batchTriangles);
+    }
+
+    void ReadMesh(CacheReader & reader, Mesh & mesh)
+    {
+        MeshRecord record;
+        reader.Read(record);
+        mesh.material = record.material;
+        mesh.boundCenter = record.boundCenter;
+        mesh.boundRadius = record.boundRadius;
+        mesh.bvh.buildCost = record.buildCost;
+        mesh.dirty = false;
+        reader.ReadArray(mesh.vertices);
+        reader.ReadArray(mesh.triangles);
+        reader.ReadArray(mesh.precomputedTriangles);
+        reader.ReadArray(mesh.bvh.nodes);
+        reader.ReadArray(mesh.bvh.indices);
+        reader.ReadArray(mesh.batches);
+        reader.ReadArray(mesh.batchTriangles);
+    }
+}
+
+void SaveSceneCache(const Scene & scene, const char * filename)
+{
+    // Meshes shared between instances are stored once, after the scene's own meshes
+    std::vector<const Mesh *> sharedMeshes;
+    std::vector<InstanceRecord> instances;
+    for(auto & instance : scene.instances)
+    {
+        auto it = std::find(begin(sharedMeshes), end(sharedMeshes), instance.mesh.get());
+        if(it == end(sharedMeshes)) it = sharedMeshes.insert(it, instance.mesh.get());
+        InstanceRecord record = {instance.material, instance.pose, (uint32_t)(it - begin(sharedMeshes))};
+        instances.push_back(record);
+    }
+
+    auto header = GetExpectedHeader();
+    header.sphereCount = (uint32_t)scene.spheres.size();
+    header.meshCount = (uint32_t)scene.meshes.size();
+    header.sharedMeshCount = (uint32_t)sharedMeshes.size();
+    header.instanceCount = (uint32_t)instances.size();
+
+    CacheWriter writer(filename);
+    writer.Write(header);
+    writer.Write(scene.skyColor);
+    writer.Write(scene.ambientLight);
+    writer.Write(scene.dirLight.direction);
+    writer.Write(scene.dirLight.color);
+    writer.WriteArray(scene.spheres);
+    for(auto & mesh : scene.meshes) WriteMesh(writer, mesh);
+    for(auto mesh : sharedMeshes) WriteMesh(writer, *mesh);
+    writer.WriteArray(instances);
+    WriteBvh(writer, scene.bvh);
+    writer.Check();
+}
+
+bool LoadSceneCache(Scene & scene, const char * filename)
+{
+    if(!std::ifstream(filename, std::ifstream::binary)) return false;
+    MappedFile file(filename);
+    CacheReader reader(file, filename);
+
+    CacheHeader header, expected = GetExpectedHeader();
+    if(!reader.CanRead(sizeof(header))) return false;
+    reader.Read(header);
+    if(memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version || header.simdWidth != expected.simdWidth
+        || header.nodeSize != expected.nodeSize || header.batchSize != expected.batchSize || header.sphereSize != expected.sphereSize) return false;
+
+    scene = Scene();
+    reader.Read(scene.skyColor);
+    reader.Read(scene.ambientLight);
+    reader.Read(scene.dirLight.direction);
+    reader.Read(scene.dirLight.color);
+    reader.ReadArray(scene.spheres);
+    for(auto & sphere : scene.spheres) sphere.dirty = false;
+
+    scene.meshes.resize(header.meshCount);
+    for(auto & mesh : scene.meshes) ReadMesh(reader, mesh);
+    std::vector<std::shared_ptr<Mesh>> sharedMeshes(header.sharedMeshCount);
+    for(auto & mesh : sharedMeshes)
+    {
+        mesh = std::make_shared<Mesh>();
+        ReadMesh(reader, *mesh);
+    }
+
+    std::vector<InstanceRecord> instances;
+    reader.ReadArray(instances);
+    for(auto & record : instances)
+    {
+        if(record.sharedMesh >= sharedMeshes.size()) throw std::runtime_error(std::string("Scene cache ") + filename + " is corrupt.");
+        MeshInstance instance = {record.material, sharedMeshes[record.sharedMesh], record.pose, false};
+        scene.instances.push_back(instance);
+    }
+    ReadBvh(reader, scene.bvh);
+    return true;
+}
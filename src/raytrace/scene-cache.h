@@ -0,0 +1,12 @@
+#pragma once
+
+#include "raytrace.h"
+
+// Saves a scene whose hierarchies have been built, together with those hierarchies, in a binary format that is loaded by mapping the file into
+// memory and copying each array straight into place, with no parsing and no building. Instances which share a mesh still share it once loaded.
+// Paged meshes are not saved, as they are traced from files of their own. The layout of the file matches the structures in memory, so files written by a build with a different SIMD_WIDTH or layout are not loaded.
+void SaveSceneCache(const Scene & scene, const char * filename);
+
+// Replaces scene with the contents of the file, returning false without changing it if the file does not exist or was written by an incompatible
+// build, in which case the caller should build the scene instead. Throws std::runtime_error if the file is truncated.
+bool LoadSceneCache(Scene & scene, const char * filename);
@@ -0,0 +1,194 @@
+#include "raytrace.h"
+#include "paged-mesh.h"
+
+// Refitted hierarchies are rebuilt once their cost has grown by this factor
+static const float maxRefitCostGrowth = 1.5f;
+
+static void BuildMesh(Mesh & mesh, ThreadPool * pool = nullptr)
+{
+    mesh.ComputeBounds();
+    mesh.PrecomputeTriangles();
+    mesh.BuildBvh(pool);
+    mesh.dirty = false;
+}
+
+static void UpdateMesh(Mesh & mesh)
+{
+    if(mesh.bvh.nodes.empty() || mesh.precomputedTriangles.size() != mesh.triangles.size()) return BuildMesh(mesh);
+    mesh.ComputeBounds();
+    mesh.PrecomputeTriangles();
+    mesh.RefitBvh();
+    if(mesh.bvh.GetCost() > mesh.bvh.buildCost * maxRefitCostGrowth) mesh.BuildBvh();
+    mesh.dirty = false;
+}
+
+std::vector<Bounds> Scene::GetObjectBounds() const
+{
+    std::vector<Bounds> bounds;
+    for(auto & sphere : spheres)
+    {
+        auto extent = float3(1,1,1) * sphere.radius;
+        bounds.push_back({sphere.position - extent, sphere.position + extent});
+    }
+    for(auto & mesh : meshes) bounds.push_back(mesh.bvh.nodes.empty() ? Bounds() : mesh.bvh.nodes[0].bounds);
+    for(auto & instance : instances) bounds.push_back(instance.GetBounds());
+    return bounds;
+}
+
+void Scene::BuildBvh(ThreadPool * pool)
+{
+    for(auto & mesh : meshes) BuildMesh(mesh, pool);
+    std::vector<const Mesh *> builtMeshes;
+    for(auto & instance : instances)
+    {
+        if(std::find(begin(builtMeshes), end(builtMeshes), instance.mesh.get()) != end(builtMeshes)) continue;
+        BuildMesh(*instance.mesh, pool);
+        builtMeshes.push_back(instance.mesh.get());
+    }
+    for(auto & sphere : spheres) sphere.dirty = false;
+    for(auto & instance : instances) instance.dirty = false;
+    bvh.Build(GetObjectBounds(), 2, 1, pool);
+}
+
+bool Scene::Update()
+{
+    // A shared mesh is updated once, but every instance of it moves
+    bool changed = false;
+    for(auto & sphere : spheres) changed |= sphere.dirty;
+    for(auto & mesh : meshes) changed |= mesh.dirty;
+    for(auto & instance : instances) changed |= instance.dirty |= instance.mesh->dirty;
+    if(!changed) return false;
+    if(bvh.nodes.empty())
+    {
+        BuildBvh();
+        return true;
+    }
+
+    for(auto & mesh : meshes) if(mesh.dirty) UpdateMesh(mesh);
+    for(auto & instance : instances) if(instance.mesh->dirty) UpdateMesh(*instance.mesh);
+    for(auto & sphere : spheres) sphere.dirty = false;
+    for(auto & instance : instances) instance.dirty = false;
+
+    // Objects with empty bounds are left out of the hierarchy, so it must be rebuilt if any object has become empty or stopped being empty
+    auto bounds = GetObjectBounds();
+    size_t nonEmptyCount = 0;
+    for(auto & b : bounds) if(!b.IsEmpty()) ++nonEmptyCount;
+    bool sameObjects = nonEmptyCount == bvh.indices.size();
+    for(int index : bvh.indices) sameObjects &= !bounds[index].IsEmpty();
+    if(!sameObjects) bvh.Build(bounds, 2);
+    else
+    {
+        bvh.Refit(bounds);
+        if(bvh.GetCost() > bvh.buildCost * maxRefitCostGrowth) bvh.Build(bounds, 2);
+    }
+    return true;
+}
+
+// Tests every object which may occlude the ray, returning as soon as one does
+static bool CheckObjectOcclusion(const Scene & scene, const Ray & ray, const Material * ignore)
+{
+    if(scene.bvh.nodes.empty())
+    {
+        for(auto & sphere : scene.spheres) if(&sphere.material != ignore && sphere.CheckOcclusion(ray)) return true;
+        for(auto & mesh : scene.meshes) if(&mesh.material != ignore && mesh.CheckOcclusion(ray)) return true;
+        for(auto & instance : scene.instances) if(&instance.material != ignore && instance.CheckOcclusion(ray)) return true;
+    }
+    else if(scene.bvh.Traverse(ray, std::numeric_limits<float>::infinity(), [&](const BvhNode & leaf, float &)
+    {
+        for(int i=leaf.first; i<leaf.first+leaf.count; ++i)
+        {
+            size_t index = scene.bvh.indices[i];
+            if(index < scene.spheres.size())
+            {
+                auto & sphere = scene.spheres[index];
+                if(&sphere.material != ignore && sphere.CheckOcclusion(ray)) return true;
+            }
+            else if(index < scene.spheres.size() + scene.meshes.size())
+            {
+                auto & mesh = scene.meshes[index - scene.spheres.size()];
+                if(&mesh.material != ignore && mesh.CheckOcclusion(ray)) return true;
+            }
+            else
+            {
+                auto & instance = scene.instances[index - scene.spheres.size() - scene.meshes.size()];
+                if(&instance.material != ignore && instance.CheckOcclusion(ray)) return true;
+            }
+        }
+        return false;
+    })) return true;
+
+    for(auto & mesh : scene.pagedMeshes) if(&mesh->material != ignore && mesh->CheckOcclusion(ray)) return true;
+    return false;
+}
+
+bool Scene::CheckOcclusion(const Ray & ray, const Material * ignore) const
+{
+    RAYTRACE_COUNT(ShadowRays, 1);
+    bool occluded = CheckObjectOcclusion(*this, ray, ignore);
+    if(occluded) RAYTRACE_COUNT(ShadowEarlyOuts, 1);
+    return occluded;
+}
+
+Hit Scene::Intersect(const Ray & ray, const Material * ignore) const
+{
+    RAYTRACE_COUNT(Rays, 1);
+    Hit bestHit;
+    if(bvh.nodes.empty())
+    {
+        for(auto & sphere : spheres)
+        {
+            if(&sphere.material == ignore) continue;
+            auto hit = sphere.Intersect(ray);
+            if(hit.distance < bestHit.distance) bestHit = hit;
+        }
+        for(auto & mesh : meshes)
+        {
+            if(&mesh.material == ignore) continue;
+            auto hit = mesh.Intersect(ray);
+            if(hit.distance < bestHit.distance) bestHit = hit;
+        }
+        for(auto & instance : instances)
+        {
+            if(&instance.material == ignore) continue;
+            auto hit = instance.Intersect(ray);
+            if(hit.distance < bestHit.distance) bestHit = hit;
+        }
+    }
+    else bvh.Traverse(ray, bestHit.distance, [&](const BvhNode & leaf, float & maxT)
+    {
+        for(int i=leaf.first; i<leaf.first+leaf.count; ++i)
+        {
+            size_t index = bvh.indices[i];
+            Hit hit;
+            if(index < spheres.size())
+            {
+                auto & sphere = spheres[index];
+                if(&sphere.material != ignore) hit = sphere.Intersect(ray);
+            }
+            else if(index < spheres.size() + meshes.size())
+            {
+                auto & mesh = meshes[index - spheres.size()];
+                if(&mesh.material != ignore) hit = mesh.Intersect(ray, maxT);
+            }
+            else
+            {
+                auto & instance = instances[index - spheres.size() - meshes.size()];
+                if(&instance.material != ignore) hit = instance.Intersect(ray, maxT);
+            }
+            if(hit.distance < bestHit.distance)
+            {
+                bestHit = hit;
+                maxT = hit.distance;
+            }
+        }
+        return false;
+    });
+    for(auto & mesh : pagedMeshes)
+    {
+        if(&mesh->material == ignore) continue;
+        auto hit = mesh->Intersect(ray, bestHit.distance);
+        if(hit.distance < bestHit.distance) bestHit = hit;
+    }
+    bestHit.point = ray.origin + ray.direction * bestHit.distance;
+    return bestHit;
+}
@@ -0,0 +1,251 @@
+#include "raytrace.h"
+#include "paged-mesh.h"
+
+#include <random>
+
+// A closed cylinder of radius 1 and height 5, standing on the origin
+static std::shared_ptr<Mesh> CreateCylinder()
+{
+    auto mesh = std::make_shared<Mesh>();
+    for(int i=0; i<24; ++i)
+    {
+        float angle = i*6.28f/24;
+        mesh->vertices.push_back({cosf(angle),0.0f,sinf(angle)});
+        mesh->vertices.push_back({cosf(angle),5.0f,sinf(angle)});
+        mesh->triangles.push_back({i*2, i*2+1, ((i+1)*2 + 1) % 48});
+        mesh->triangles.push_back({i*2, ((i+1)*2 + 1) % 48, (i+1)*2 % 48});
+        if(i>1) mesh->triangles.push_back({1,i*2+1,(i-1)*2+1});
+    }
+    return mesh;
+}
+
+Scene CreateExampleScene()
+{
+    Scene scene;
+    scene.skyColor = float3(0,0.5f,1.0f);
+    scene.ambientLight = float3(0.3f,0.3f,0.3f);
+    scene.dirLight.direction = norm(float3(0.2f,1,-0.1f));
+    scene.dirLight.color = {0.8f,0.8f,0.5f};
+    scene.spheres.push_back({Material{{1,1,1}}, {0,0,-5}, 2, false});
+    scene.spheres.push_back({Material{{1,0.5f,0.5f},0.5f}, {3,-1,-7}, 2, false});
+    scene.spheres.push_back({Material{{0.3f,1,0.3f}}, {-3,-2,-6}, 2, false});
+    scene.spheres.push_back({Material{{0.4f,0.4f,1}}, {-1.5f,+2,-6}, 2, false});
+
+    scene.meshes.push_back({
+        Material{{0.5f,0.3f,0.1f}},
+        {{-10,-4,0}, {10,-4,0}, {10,-4,-20}, {-10,-4,-20}},
+        {{0,1,2}, {0,2,3}},
+        false
+    });
+
+    scene.instances.push_back({Material{{1.0f,1.0f,0}}, CreateCylinder(), Pose({4.0f,-4.0f,-4.0f}, {0,0,0,1}), false});
+    return scene;
+}
+
+Scene CreateForestScene(int size)
+{
+    Scene scene;
+    scene.skyColor = float3(0,0.5f,1.0f);
+    scene.ambientLight = float3(0.3f,0.3f,0.3f);
+    scene.dirLight.direction = norm(float3(0.2f,1,-0.1f));
+    scene.dirLight.color = {0.8f,0.8f,0.5f};
+
+    float extent = size * 4.0f;
+    scene.meshes.push_back({
+        Material{{0.5f,0.3f,0.1f}},
+        {{-extent,-4,0}, {extent,-4,0}, {extent,-4,-extent*2}, {-extent,-4,-extent*2}},
+        {{0,1,2}, {0,2,3}},
+        false
+    });
+
+    // Every trunk shares one mesh, leaning and turning by a different amount
+    auto cylinder = CreateCylinder();
+    for(int i=0; i<size*size; ++i)
+    {
+        int x = i % size, z = i / size;
+        float yaw = i * 2.4f, lean = (i % 7 - 3) * 0.05f;
+        auto orientation = qmul(float4(0, std::sin(yaw/2), 0, std::cos(yaw/2)), float4(std::sin(lean/2), 0, 0, std::cos(lean/2)));
+        scene.instances.push_back({Material{{0.4f + (i % 5) * 0.1f, 0.3f, 0.2f}}, cylinder, Pose({(x - size*0.5f + 0.5f) * 8, -4, -8.0f - z * 8}, orientation), false});
+    }
+    return scene;
+}
+
+// Uniform in [min, max). std::mt19937 produces the same sequence everywhere, unlike the standard distributions, so scenes built with it can be
+// compared between builds and platforms.
+static float GetRandom(std::mt19937 & engine, float min, float max)
+{
+    return min + (max - min) * (float)(engine() / 4294967296.0);
+}
+
+Scene CreateSpheresScene(int count, float reflectivity)
+{
+    Scene scene;
+    scene.skyColor = float3(0,0.5f,1.0f);
+    scene.ambientLight = float3(0.3f,0.3f,0.3f);
+    scene.dirLight.direction = norm(float3(0.2f,1,-0.1f));
+    scene.dirLight.color = {0.8f,0.8f,0.5f};
+
+    // Spheres fill a cube in front of the view, growing with the count so that they stay equally dense
+    std::mt19937 engine;
+    float side = std::cbrt((float)count) * 3;
+    for(int i=0; i<count; ++i)
+    {
+        float3 position = {GetRandom(engine, -side/2, side/2), GetRandom(engine, -3, side-3), GetRandom(engine, -side-4, -4)};
+        float3 albedo = {GetRandom(engine, 0.2f, 1), GetRandom(engine, 0.2f, 1), GetRandom(engine, 0.2f, 1)};
+        scene.spheres.push_back({Material{albedo, reflectivity}, position, GetRandom(engine, 0.5f, 1), false});
+    }
+
+    float extent = side * 2 + 8;
+    scene.meshes.push_back({
+        Material{{0.5f,0.3f,0.1f}, reflectivity},
+        {{-extent,-4,extent}, {extent,-4,extent}, {extent,-4,-extent}, {-extent,-4,-extent}},
+        {{0,1,2}, {0,2,3}},
+        false
+    });
+    return scene;
+}
+
+Scene CreateTrianglesScene(int count)
+{
+    // A lumpy sphere, split into rings of quads, with about as many triangles as requested
+    int rings = std::max((int)std::sqrt(count / 4.0f), 2), segments = rings * 2;
+    auto mesh = std::make_shared<Mesh>();
+    mesh->material = {{0.8f,0.8f,0.8f}};
+    for(int i=0; i<=rings; ++i)
+    {
+        float latitude = i * 3.14159265f / rings;
+        for(int j=0; j<segments; ++j)
+        {
+            float longitude = j * 6.28318531f / segments, radius = 1 + 0.1f * std::sin(latitude * 7) * std::sin(longitude * 9);
+            mesh->vertices.push_back(float3(std::sin(latitude) * std::cos(longitude), std::cos(latitude), std::sin(latitude) * std::sin(longitude)) * radius);
+        }
+    }
+    for(int i=0; i<rings; ++i)
+    {
+        for(int j=0; j<segments; ++j)
+        {
+            int a = i*segments + j, b = i*segments + (j+1) % segments;
+            mesh->triangles.push_back({a, b, b+segments});
+            mesh->triangles.push_back({a, b+segments, a+segments});
+        }
+    }
+    return CreateModelScene(mesh);
+}
+
+Scene CreateCanopyScene(int count)
+{
+    Scene scene;
+    scene.skyColor = float3(0,0.5f,1.0f);
+    scene.ambientLight = float3(0.3f,0.3f,0.3f);
+    scene.dirLight.direction = norm(float3(0.2f,1,-0.1f));
+    scene.dirLight.color = {0.8f,0.8f,0.5f};
+
+    float extent = std::sqrt((float)count) / 4;
+    scene.meshes.push_back({
+        Material{{0.5f,0.3f,0.1f}},
+        {{-extent*2,-4,0}, {extent*2,-4,0}, {extent*2,-4,-extent*4}, {-extent*2,-4,-extent*4}},
+        {{0,1,2}, {0,2,3}},
+        false
+    });
+
+    // Leaves cover about half of the sky seen from the ground, in a layer above the view
+    Mesh leaves = {Material{{0.2f,0.6f,0.2f}}, {}, {}, false};
+    std::mt19937 engine;
+    for(int i=0; i<count; ++i)
+    {
+        float3 center = {GetRandom(engine, -extent*2, extent*2), GetRandom(engine, 2, 6), GetRandom(engine, -extent*4, 0)};
+        int first = (int)leaves.vertices.size();
+        for(int j=0; j<3; ++j) leaves.vertices.push_back(center + float3(GetRandom(engine, -1.5f, 1.5f), GetRandom(engine, -0.3f, 0.3f), GetRandom(engine, -1.5f, 1.5f)));
+        leaves.triangles.push_back({first, first+1, first+2});
+    }
+    scene.meshes.push_back(leaves);
+    return scene;
+}
+
+// Turns points by angle about the vertical axis through center
+static Pose GetTurnAbout(const float3 & center, float angle)
+{
+    auto orientation = float4(0, std::sin(angle/2), 0, std::cos(angle/2));
+    return {center - qrot(orientation, center), orientation};
+}
+
+void AnimateScene(Scene & scene, float seconds)
+{
+    // Each motion turns about a vertical axis, so that objects circle instead of drifting out of the scene however long it is animated
+    for(size_t i=1; i<scene.spheres.size(); i+=2)
+    {
+        auto & a = scene.spheres[i-1], & b = scene.spheres[i];
+        auto turn = GetTurnAbout((a.position + b.position) * 0.5f, seconds);
+        a.position = turn.TransformPoint(a.position);
+        b.position = turn.TransformPoint(b.position);
+        a.dirty = b.dirty = true;
+    }
+    for(size_t i=1; i<scene.instances.size(); i+=2)
+    {
+        auto & a = scene.instances[i-1], & b = scene.instances[i];
+        auto turn = GetTurnAbout((a.pose.position + b.pose.position) * 0.5f, seconds);
+        a.pose = turn * a.pose;
+        b.pose = turn * b.pose;
+        a.dirty = b.dirty = true;
+    }
+    if(scene.instances.size() % 2)
+    {
+        auto & instance = scene.instances.back();
+        instance.pose = GetTurnAbout(instance.pose.TransformPoint({2,0,0}), seconds * 2) * instance.pose;
+        instance.dirty = true;
+    }
+
+    // Higher vertices turn faster, so that the mesh is twisted rather than only moved
+    if(scene.instances.empty() && scene.meshes.empty()) return;
+    auto & mesh = scene.instances.empty() ? scene.meshes.back() : *scene.instances.front().mesh;
+    float3 center;
+    for(auto & vertex : mesh.vertices) center += vertex;
+    center *= 1.0f / mesh.vertices.size();
+    for(auto & vertex : mesh.vertices) vertex = GetTurnAbout(center, seconds * (vertex.y - center.y) * 0.5f).TransformPoint(vertex);
+    mesh.dirty = true;
+}
+
+// Lights and a ground plane for a model with the given bounds, which is to be moved by offset, so that it fills the view from the default pose
+static Scene CreateStage(Bounds modelBounds, float3 & offset)
+{
+    Scene scene;
+    scene.skyColor = float3(0,0.5f,1.0f);
+    scene.ambientLight = float3(0.3f,0.3f,0.3f);
+    scene.dirLight.direction = norm(float3(0.2f,1,-0.1f));
+    scene.dirLight.color = {0.8f,0.8f,0.5f};
+
+    // The view spans 45 degrees either side of straight ahead, so a bounding sphere twice its radius away fills most of it
+    if(modelBounds.IsEmpty()) modelBounds = {{0,0,0}, {0,0,0}};
+    auto center = modelBounds.GetCenter();
+    float radius = std::max(mag(modelBounds.max - center), 1e-3f);
+    offset = float3(0,0,-radius*2) - center;
+
+    float floor = modelBounds.min.y + offset.y, extent = radius * 8;
+    scene.meshes.push_back({
+        Material{{0.5f,0.3f,0.1f}},
+        {{-extent,floor,extent}, {extent,floor,extent}, {extent,floor,-extent}, {-extent,floor,-extent}},
+        {{0,1,2}, {0,2,3}},
+        false
+    });
+    return scene;
+}
+
+Scene CreateModelScene(std::shared_ptr<Mesh> model)
+{
+    Bounds bounds;
+    for(auto & vertex : model->vertices) bounds.Include(vertex);
+    float3 offset;
+    auto scene = CreateStage(bounds, offset);
+    scene.instances.push_back({model->material, model, Pose(offset, {0,0,0,1}), false});
+    return scene;
+}
+
+Scene CreatePagedModelScene(std::shared_ptr<PagedMesh> model)
+{
+    model->pose = Pose();
+    float3 offset;
+    auto scene = CreateStage(model->GetBounds(), offset);
+    model->pose = Pose(offset, {0,0,0,1});
+    scene.pagedMeshes.push_back(model);
+    return scene;
+}
@@ -0,0 +1,63 @@
+#include "stats.h"
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+RAYTRACE_THREAD_LOCAL ThreadCounters * threadCounters;
+
+// Counters of every thread which has counted anything, which are never freed, so that totals include threads which have since exited
+static std::mutex registryMutex;
+static std::vector<std::unique_ptr<ThreadCounters>> registry;
+
+ThreadCounters * CreateThreadCounters()
+{
+    std::unique_ptr<ThreadCounters> counters(new ThreadCounters);
+    for(auto & value : counters->values) value.store(0);
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.push_back(std::move(counters));
+    return threadCounters = registry.back().get();
+}
+
+const char * GetCounterName(Counter counter)
+{
+    switch(counter)
+    {
+    case Counter::Rays: return "rays";
+    case Counter::ShadowRays: return "shadowRays";
+    case Counter::ShadowEarlyOuts: return "shadowEarlyOuts";
+    case Counter::NodeVisits: return "nodeVisits";
+    case Counter::SphereTests: return "sphereTests";
+    case Counter::BoundingSphereRejects: return "boundingSphereRejects";
+    case Counter::TriangleTests: return "triangleTests";
+    default: return "unknown";
+    }
+}
+
+CounterTotals GetCounterTotals()
+{
+    CounterTotals totals = {};
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for(auto & counters : registry)
+    {
+        for(int i=0; i<(int)Counter::Count; ++i) totals.values[i] += counters->values[i].load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+void SaveCounters(const CounterTotals & totals, const char * filename)
+{
+    std::ofstream out(filename);
+    if(!out) throw std::runtime_error(std::string("Unable to write ") + filename + ".");
+#ifdef RAYTRACE_STATS
+    out << "{\n  \"enabled\": true";
+#else
+    out << "{\n  \"enabled\": false";
+#endif
+    for(int i=0; i<(int)Counter::Count; ++i) out << ",\n  \"" << GetCounterName((Counter)i) << "\": " << totals.values[i];
+    out << "\n}\n";
+    if(!out) throw std::runtime_error(std::string("Unable to write ") + filename + ".");
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Counts of the work done while tracing. Each thread adds to counters of its own, which are only summed when the totals are read, so counting
+// never contends between threads. Counting is only compiled in if RAYTRACE_STATS is defined. Otherwise RAYTRACE_COUNT expands to nothing, without
+// evaluating its amount, and every total stays zero.
+enum class Counter
+{
+    Rays,                   // Rays intersected with the scene, including reflections
+    ShadowRays,             // Rays tested for occlusion by the scene
+    ShadowEarlyOuts,        // Shadow rays which ended at the first occluder found, rather than traversing the whole scene
+    NodeVisits,             // Hierarchy nodes visited, by one ray or by one packet of rays
+    SphereTests,            // Ray-sphere tests, counting every SIMD lane of packets
+    BoundingSphereRejects,  // Rays which missed the bounding sphere of a mesh without a hierarchy
+    TriangleTests,          // Ray-triangle tests, counting every SIMD lane of batches and packets
+    Count
+};
+
+struct CounterTotals
+{
+    int64_t values[(int)Counter::Count];
+
+    int64_t operator[](Counter counter) const { return values[(int)counter]; }
+    CounterTotals operator - (const CounterTotals & other) const
+    {
+        CounterTotals difference;
+        for(int i=0; i<(int)Counter::Count; ++i) difference.values[i] = values[i] - other.values[i];
+        return difference;
+    }
+};
+
+const char * GetCounterName(Counter counter); // As written by SaveCounters
+CounterTotals GetCounterTotals(); // Safe to call while other threads are counting, in which case their latest counts may not be included
+
+// Writes the totals as a JSON object with one member per counter, and whether counting was compiled in. Throws std::runtime_error on failure.
+void SaveCounters(const CounterTotals & totals, const char * filename);
+
+#if defined(_MSC_VER)
+#define RAYTRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define RAYTRACE_THREAD_LOCAL __thread
+#endif
+
+// Only the owning thread adds to its counters, so a relaxed load and store is enough, and avoids a locked instruction
+struct ThreadCounters
+{
+    std::atomic<int64_t> values[(int)Counter::Count];
+};
+
+extern RAYTRACE_THREAD_LOCAL ThreadCounters * threadCounters;
+ThreadCounters * CreateThreadCounters(); // Sets threadCounters for the calling thread, which keeps its counts in the totals after it exits
+
+inline void AddToCounter(Counter counter, int64_t amount)
+{
+    auto counters = threadCounters ? threadCounters : CreateThreadCounters();
+    auto & value = counters->values[(int)counter];
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// Hierarchy nodes visited plus intersection tests made by the calling thread so far, which stays zero unless counting is compiled in
+inline int64_t GetThreadWork()
+{
+    auto counters = threadCounters ? threadCounters : CreateThreadCounters();
+    return counters->values[(int)Counter::NodeVisits].load(std::memory_order_relaxed) + counters->values[(int)Counter::SphereTests].load(std::memory_order_relaxed)
+        + counters->values[(int)Counter::TriangleTests].load(std::memory_order_relaxed);
+}
+
+inline int CountBits(uint64_t bits)
+{
+    int count = 0;
+    for(; bits; bits &= bits - 1) ++count;
+    return count;
+}
+
+#ifdef RAYTRACE_STATS
+#define RAYTRACE_COUNT(counter, amount) AddToCounter(Counter::counter, amount)
+#else
+#define RAYTRACE_COUNT(counter, amount) ((void)0)
+#endif
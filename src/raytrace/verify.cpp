@@ -0,0 +1,265 @@
+#include "paged-mesh.h"
+#include "scene-cache.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static const char * usage = "Usage: verify [-w width] [-h height] [-t threads] [-e pixel-tolerance] [-r max-rmse] [-f max-failing-pixels] [-g golden-directory] [-o failure-directory] [example|forest|spheres|reflections|triangles|shadows|paged|animated|animated-spheres]...";
+
+// Files written while checking, in the working directory, and removed once each check is done
+static const char * pagedMeshFile = "verify-paged-mesh.tmp";
+static const char * sceneCacheFile = "verify-scene-cache.tmp";
+
+// The triangles scene, with its mesh written to a paged file in blocks of 64 triangles and traced with a budget too small for more than one block,
+// so that rays are deferred, and blocks evicted and loaded again, throughout every render
+static Scene CreatePagedTrianglesScene(ThreadPool & pool)
+{
+    auto resident = CreateTrianglesScene(2000);
+    auto & model = *resident.instances[0].mesh;
+    model.ComputeBounds();
+    model.PrecomputeTriangles();
+    model.BuildBvh();
+    WritePagedMesh(model, pagedMeshFile, 64);
+    auto paged = std::make_shared<PagedMesh>(pagedMeshFile, 1);
+    paged->material = model.material;
+    auto scene = CreatePagedModelScene(paged);
+    scene.BuildBvh(&pool);
+    return scene;
+}
+
+// Scenes are animated for several seconds, for the reference without hierarchies, and for the accelerated paths with hierarchies built before the
+// first step and brought up to date by Scene::Update after each one, so that they are refitted, and rebuilt once refitting has made them too costly
+static const int animationSteps = 30;
+static const float animationStep = 0.1f;
+
+static Scene Animate(Scene scene)
+{
+    for(int i=0; i<animationSteps; ++i) AnimateScene(scene, animationStep);
+    return scene;
+}
+
+static Scene AnimateWithUpdates(Scene scene, ThreadPool & pool)
+{
+    scene.BuildBvh(&pool);
+    for(int i=0; i<animationSteps; ++i)
+    {
+        AnimateScene(scene, animationStep);
+        scene.Update();
+    }
+    return scene;
+}
+
+// Scenes are kept small, as the reference render tests every ray against every object and triangle
+struct ReferenceScene
+{
+    const char * name;
+    std::function<Scene()> create;
+    std::function<Scene(ThreadPool & pool)> createAccelerated; // If set, creates the scene traced by the accelerated paths with its hierarchies built,
+                                                               // which should look the same as the reference
+};
+
+static const ReferenceScene referenceScenes[] = {
+    {"example", []() { return CreateExampleScene(); }},
+    {"forest", []() { return CreateForestScene(4); }},
+    {"spheres", []() { return CreateSpheresScene(200, 0); }},
+    {"reflections", []() { return CreateSpheresScene(50, 0.8f); }},
+    {"triangles", []() { return CreateTrianglesScene(2000); }},
+    {"shadows", []() { return CreateCanopyScene(1000); }},
+    {"paged", []() { return CreateTrianglesScene(2000); }, CreatePagedTrianglesScene},
+    {"animated", []() { return Animate(CreateExampleScene()); }, [](ThreadPool & pool) { return AnimateWithUpdates(CreateExampleScene(), pool); }},
+    {"animated-spheres", []() { return Animate(CreateSpheresScene(200, 0)); }, [](ThreadPool & pool) { return AnimateWithUpdates(CreateSpheresScene(200, 0), pool); }}
+};
+
+// Every way of tracing a scene whose hierarchies have been built, each of which should match the reference
+struct RenderPath
+{
+    const char * name;
+    std::function<void(const Scene & scene, int2 dimensions, RaytracedImage & image, ThreadPool & pool)> render;
+};
+
+static void RenderTiles(const Scene & scene, int2 dimensions, RaytracedImage & image, ThreadPool & pool, int packetSize)
+{
+    image.packetSize = packetSize;
+    image.Reset(dimensions, Pose(), {32,32});
+    image.RaytraceParallel(scene, pool);
+    image.Wait();
+}
+
+static const RenderPath renderPaths[] = {
+    {"bvh", [](const Scene & scene, int2 dimensions, RaytracedImage & image, ThreadPool & pool) { RenderTiles(scene, dimensions, image, pool, 1); }},
+    {"packets-2x2", [](const Scene & scene, int2 dimensions, RaytracedImage & image, ThreadPool & pool) { RenderTiles(scene, dimensions, image, pool, 2); }},
+    {"packets-4x4", [](const Scene & scene, int2 dimensions, RaytracedImage & image, ThreadPool & pool) { RenderTiles(scene, dimensions, image, pool, 4); }},
+    {"packets-8x8", [](const Scene & scene, int2 dimensions, RaytracedImage & image, ThreadPool & pool) { RenderTiles(scene, dimensions, image, pool, 8); }},
+    {"wavefront", [](const Scene & scene, int2 dimensions, RaytracedImage & image, ThreadPool & pool)
+    {
+        // The recursive renderer follows reflections until they escape, so the bounce limit is set well beyond what contributes visibly
+        WavefrontRenderer renderer;
+        renderer.maxDepth = 64;
+        image.Reset(dimensions, Pose(), dimensions);
+        renderer.Render(scene, image, &pool);
+    }}
+};
+
+// Prepares every mesh for tracing without building any hierarchy, so that the scene is traced by testing each ray against every object, and
+// every triangle of each mesh in turn
+static void PrepareWithoutHierarchies(Scene & scene)
+{
+    for(auto & mesh : scene.meshes)
+    {
+        mesh.ComputeBounds();
+        mesh.PrecomputeTriangles();
+    }
+    for(auto & instance : scene.instances)
+    {
+        instance.mesh->ComputeBounds();
+        instance.mesh->PrecomputeTriangles();
+    }
+}
+
+struct Thresholds
+{
+    float pixelTolerance, maxRmse;
+    int maxFailingPixels;
+};
+
+// Prints the differences between the expected and actual images of a check, and returns true if they are within the thresholds. Otherwise, if
+// a directory is given, both images are written to it.
+static bool CheckImage(const std::string & scene, const std::string & name, const RaytracedImage & expected, const RaytracedImage & actual, const Thresholds & thresholds, const std::string & failureDirectory)
+{
+    auto difference = CompareImages(expected, actual, thresholds.pixelTolerance);
+    bool passed = difference.failingPixels <= thresholds.maxFailingPixels && difference.rmse <= thresholds.maxRmse;
+    std::cout << "  " << name << ": max " << difference.maxError << ", rmse " << difference.rmse << ", " << difference.failingPixels << " failing pixels" << (passed ? "" : " FAILED") << std::endl;
+    if(!passed && !failureDirectory.empty())
+    {
+        expected.SavePFM((failureDirectory + "/" + scene + "-" + name + "-expected.pfm").c_str());
+        actual.SavePFM((failureDirectory + "/" + scene + "-" + name + "-actual.pfm").c_str());
+    }
+    return passed;
+}
+
+int main(int argc, char * argv[]) try
+{
+    int2 dimensions = {320,180};
+    int threads = std::thread::hardware_concurrency();
+    Thresholds thresholds = {1e-3f, 1e-4f, 0};
+    std::string goldenDirectory, failureDirectory;
+    std::vector<std::string> names;
+    for(int i=1; i<argc; ++i)
+    {
+        if(strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "-o") == 0)
+        {
+            if(i+1 == argc) throw std::runtime_error(usage);
+            auto & value = strcmp(argv[i], "-g") == 0 ? goldenDirectory : failureDirectory;
+            value = argv[++i];
+        }
+        else if(strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "-r") == 0)
+        {
+            if(i+1 == argc) throw std::runtime_error(usage);
+            float value = (float)atof(argv[++i]);
+            if(!(value >= 0)) throw std::runtime_error(usage);
+            auto & threshold = strcmp(argv[i-1], "-e") == 0 ? thresholds.pixelTolerance : thresholds.maxRmse;
+            threshold = value;
+        }
+        else if(argv[i][0] == '-')
+        {
+            if(i+1 == argc) throw std::runtime_error(usage);
+            int value = atoi(argv[++i]);
+            if(strcmp(argv[i-1], "-f") == 0 && value >= 0) thresholds.maxFailingPixels = value;
+            else if(value <= 0) throw std::runtime_error(usage);
+            else if(strcmp(argv[i-1], "-w") == 0) dimensions.x = value;
+            else if(strcmp(argv[i-1], "-h") == 0) dimensions.y = value;
+            else if(strcmp(argv[i-1], "-t") == 0) threads = value;
+            else throw std::runtime_error(usage);
+        }
+        else names.push_back(argv[i]);
+    }
+    if(names.empty()) for(auto & scene : referenceScenes) names.push_back(scene.name);
+
+    // Each scene is traced without hierarchies as the reference, then compared against the golden image if one exists, or written as the golden
+    // image if not, and against every accelerated path
+    ThreadPool pool(threads);
+    int checkCount = 0, failureCount = 0;
+    for(auto & name : names)
+    {
+        auto scene = std::find_if(std::begin(referenceScenes), std::end(referenceScenes), [&](const ReferenceScene & s) { return name == s.name; });
+        if(scene == std::end(referenceScenes)) throw std::runtime_error(usage);
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        auto referenceScene = scene->create();
+        PrepareWithoutHierarchies(referenceScene);
+        RaytracedImage reference;
+        reference.Reset(dimensions, Pose(), {32,32});
+        reference.RaytraceParallel(referenceScene, pool);
+        reference.Wait();
+        std::cout << name << ": reference traced in " << std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - t0).count() * 1000 << " ms" << std::endl;
+
+        if(!goldenDirectory.empty())
+        {
+            auto goldenFile = goldenDirectory + "/" + name + ".pfm";
+            if(std::ifstream(goldenFile.c_str()))
+            {
+                RaytracedImage golden;
+                golden.LoadPFM(goldenFile.c_str());
+                if(golden.dimensions != dimensions) throw std::runtime_error(goldenFile + " was not traced at the requested dimensions.");
+                failureCount += !CheckImage(name, "golden", golden, reference, thresholds, failureDirectory);
+                ++checkCount;
+            }
+            else
+            {
+                reference.SavePFM(goldenFile.c_str());
+                std::cout << "  Wrote " << goldenFile << std::endl;
+            }
+        }
+
+        // A new copy of the scene is built, as instances of meshes built for it would share their hierarchies with the reference scene
+        Scene builtScene;
+        if(scene->createAccelerated) builtScene = scene->createAccelerated(pool);
+        else
+        {
+            builtScene = scene->create();
+            builtScene.BuildBvh(&pool);
+        }
+        for(auto & path : renderPaths)
+        {
+            RaytracedImage image;
+            path.render(builtScene, dimensions, image, pool);
+            failureCount += !CheckImage(name, path.name, reference, image, thresholds, failureDirectory);
+            ++checkCount;
+        }
+
+        // The built scene is also saved to a cache and loaded again, with its hierarchies, unless it has paged meshes, which are not saved
+        if(builtScene.pagedMeshes.empty())
+        {
+            Scene cachedScene;
+            SaveSceneCache(builtScene, sceneCacheFile);
+            bool loaded = LoadSceneCache(cachedScene, sceneCacheFile);
+            std::remove(sceneCacheFile);
+            if(!loaded) throw std::runtime_error(std::string("Unable to load ") + sceneCacheFile + " after saving it.");
+            RaytracedImage image;
+            renderPaths[0].render(cachedScene, dimensions, image, pool);
+            failureCount += !CheckImage(name, "scene-cache", reference, image, thresholds, failureDirectory);
+            ++checkCount;
+        }
+        builtScene = Scene(); // Unmaps any paged mesh, so that its file can be removed
+        std::remove(pagedMeshFile);
+    }
+
+    if(failureCount) std::cout << failureCount << " of " << checkCount << " checks failed" << std::endl;
+    else std::cout << "All " << checkCount << " checks passed" << std::endl;
+    return failureCount ? 1 : 0;
+}
+catch(const std::exception & e)
+{
+    std::cerr << e.what() << std::endl;
+    return -1;
+}
@@ -0,0 +1,135 @@
+#include "wavefront.h"
+
+#include <chrono>
+
+static double GetSeconds(std::chrono::high_resolution_clock::time_point since)
+{
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - since).count();
+}
+
+// Runs body(begin, end) over [0, count), in parallel if a pool is given, skipping ranges which begin after cancelled is set. Ranges begin at
+// multiples of 64, so may own whole words of a bitmask.
+template<class F> static void ForEachRange(ThreadPool * pool, size_t count, const std::atomic<bool> & cancelled, F body)
+{
+    auto range = [&](int begin, int end) { if(!cancelled) body(begin, end); };
+    if(pool) pool->ParallelFor((int)count, 1024, range);
+    else for(int begin=0; begin<(int)count; begin+=1024) range(begin, std::min(begin+1024, (int)count));
+}
+
+void WavefrontRenderer::RayQueue::Compact()
+{
+    size_t size = 0;
+    for(size_t i=0; i<rays.size(); ++i)
+    {
+        if(pixels[i] < 0) continue;
+        rays[size] = rays[i];
+        ignore[size] = ignore[i];
+        pixels[size] = pixels[i];
+        weights[size] = weights[i];
+        ++size;
+    }
+    Resize(size);
+}
+
+void WavefrontRenderer::Generate(const RaytracedImage & image)
+{
+    paths.Resize(image.dimensions.x * image.dimensions.y);
+    for(int y=0, i=0; y<image.dimensions.y; ++y)
+    {
+        for(int x=0; x<image.dimensions.x; ++x, ++i)
+        {
+            paths.rays[i] = image.GetPrimaryRay({x,y});
+            paths.ignore[i] = nullptr;
+            paths.pixels[i] = i;
+            paths.weights[i] = {1,1,1};
+        }
+    }
+}
+
+void WavefrontRenderer::Intersect(const Scene & scene, ThreadPool * pool)
+{
+    hits.resize(paths.GetSize());
+    ForEachRange(pool, paths.GetSize(), *cancelled, [&](int begin, int end)
+    {
+        scene.IntersectStream(paths.rays.data() + begin, paths.ignore.data() + begin, end - begin, hits.data() + begin);
+    });
+    pathRayCount += paths.GetSize();
+}
+
+void WavefrontRenderer::Shade(const Scene & scene, ThreadPool * pool, bool queueReflections)
+{
+    // Each path writes to its own slot in both output queues, which are compacted afterwards, so that paths can be shaded in any order
+    shadows.Resize(paths.GetSize());
+    reflections.Resize(paths.GetSize());
+    ForEachRange(pool, paths.GetSize(), *cancelled, [&](int begin, int end)
+    {
+        for(int i=begin; i<end; ++i)
+        {
+            int pixel = paths.pixels[i];
+            auto & weight = paths.weights[i];
+            auto & hit = hits[i];
+            shadows.pixels[i] = reflections.pixels[i] = -1;
+            if(!hit.IsHit())
+            {
+                radiance[pixel] += weight * scene.skyColor;
+                continue;
+            }
+
+            // The same terms as Scene::ComputeLighting, with the shadow ray and reflection deferred to later stages
+            radiance[pixel] += weight * hit.material->albedo * scene.ambientLight;
+            auto eyeDir = norm(paths.rays[i].origin - hit.point);
+            shadows.rays[i] = {hit.point, scene.dirLight.direction};
+            shadows.ignore[i] = hit.material;
+            shadows.pixels[i] = pixel;
+            shadows.weights[i] = weight * scene.dirLight.ComputeContribution(hit, eyeDir);
+            if(hit.material->reflectivity && queueReflections)
+            {
+                auto direction = -eyeDir;
+                direction -= hit.normal * (dot(direction, hit.normal) * 2);
+                reflections.rays[i] = {hit.point, direction};
+                reflections.ignore[i] = hit.material;
+                reflections.pixels[i] = pixel;
+                reflections.weights[i] = weight * hit.material->albedo * hit.material->reflectivity;
+            }
+        }
+    });
+    shadows.Compact();
+    reflections.Compact();
+}
+
+void WavefrontRenderer::TraceShadows(const Scene & scene, ThreadPool * pool)
+{
+    // Every shadow ray belongs to a different pixel, so they can safely accumulate light in parallel
+    occluded.resize((shadows.GetSize() + 63) / 64);
+    ForEachRange(pool, shadows.GetSize(), *cancelled, [&](int begin, int end)
+    {
+        scene.CheckOcclusionStream(shadows.rays.data() + begin, shadows.ignore.data() + begin, end - begin, occluded.data() + begin/64);
+        for(int i=begin; i<end; ++i) if(!(occluded[i/64] >> (i%64) & 1)) radiance[shadows.pixels[i]] += shadows.weights[i];
+    });
+    shadowRayCount += shadows.GetSize();
+}
+
+void WavefrontRenderer::Render(const Scene & scene, RaytracedImage & image, ThreadPool * pool)
+{
+    pathRayCount = shadowRayCount = 0;
+    primarySeconds = reflectionSeconds = shadowSeconds = 0;
+    cancelled = &image.cancelled;
+    radiance.assign(image.GetPixelCount(), float3());
+    Generate(image);
+    for(int depth=0; paths.GetSize() && !image.cancelled; ++depth)
+    {
+        auto t0 = std::chrono::high_resolution_clock::now();
+        Intersect(scene, pool);
+        (depth ? reflectionSeconds : primarySeconds) += GetSeconds(t0);
+        if(image.cancelled) break;
+        Shade(scene, pool, depth < maxDepth);
+        if(image.cancelled) break;
+        t0 = std::chrono::high_resolution_clock::now();
+        TraceShadows(scene, pool);
+        shadowSeconds += GetSeconds(t0);
+        paths.Swap(reflections);
+    }
+    if(image.cancelled) return;
+    for(int i=0; i<image.GetPixelCount(); ++i) image.SetPixel(i, radiance[i]);
+    image.MarkComplete();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "image.h"
+
+// Traces an image breadth-first instead of one pixel at a time. Each stage runs over a whole queue of rays before the next begins:
+// a primary ray is generated for every pixel, then every ray is intersected, then every hit is shaded, which queues a shadow ray
+// and possibly a reflection ray. The shadow rays are traced, and the reflection rays become the next queue, until it runs dry.
+class WavefrontRenderer
+{
+    // Queued rays in structure-of-arrays layout, so that the rays can be passed to the scene's stream functions
+    struct RayQueue
+    {
+        std::vector<Ray> rays;
+        std::vector<const Material *> ignore;
+        std::vector<int> pixels;
+        std::vector<float3> weights; // For path rays, scales the light carried back along the ray. For shadow rays, the light reaching the pixel unless occluded.
+
+        size_t GetSize() const { return rays.size(); }
+        void Resize(size_t size) { rays.resize(size); ignore.resize(size); pixels.resize(size); weights.resize(size); }
+        void Swap(RayQueue & other) { rays.swap(other.rays); ignore.swap(other.ignore); pixels.swap(other.pixels); weights.swap(other.weights); }
+        void Compact(); // Removes entries whose pixel is negative
+    };
+
+    RayQueue paths, reflections, shadows;
+    std::vector<Hit> hits;
+    std::vector<uint64_t> occluded;
+    std::vector<float3> radiance; // Light gathered for each pixel, kept at full precision until the image is written
+    const std::atomic<bool> * cancelled; // The cancelled flag of the image being rendered
+
+    void Generate(const RaytracedImage & image);
+    void Intersect(const Scene & scene, ThreadPool * pool);
+    void Shade(const Scene & scene, ThreadPool * pool, bool queueReflections);
+    void TraceShadows(const Scene & scene, ThreadPool * pool);
+public:
+    int maxDepth;                       // Number of reflection bounces traced after the primary rays
+    int64_t pathRayCount, shadowRayCount; // Rays traced by the last call to Render, of which the first pixel count path rays are primary rays
+    double primarySeconds, reflectionSeconds, shadowSeconds; // Time the last call to Render spent intersecting each kind of ray, excluding shading
+
+    WavefrontRenderer() : cancelled(), maxDepth(8), pathRayCount(), shadowRayCount(), primarySeconds(), reflectionSeconds(), shadowSeconds() {}
+
+    // Traces every pixel of an image which has just been Reset, running each stage on the pool if one is given, and marks it complete. If another
+    // thread sets the image's cancelled flag, chunks of rays not yet begun are skipped, and the render returns once those in progress are done,
+    // leaving the image incomplete.
+    void Render(const Scene & scene, RaytracedImage & image, ThreadPool * pool);
+};